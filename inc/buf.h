@@ -9,6 +9,11 @@ struct buf {
   struct buf *next;
   struct buf *qnext; // disk queue
   uchar data[BSIZE];
+  // swap I/O: if pages is set, the request moves npages whole pages
+  // starting at blockno straight to/from pages[], not data
+  char **pages;
+  uint npages;
+  uint sectdone; // sectors transferred so far
 };
 #define B_VALID 0x2 // buffer has been read from disk
 #define B_DIRTY 0x4 // buffer needs to be written to disk
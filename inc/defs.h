@@ -3,14 +3,20 @@
 
 struct buf;
 struct context;
+struct core_map_entry;
 struct extent;
+struct finfo;
 struct inode;
 struct proc;
 struct rtcdate;
+struct shm;
 struct spinlock;
 struct sleeplock;
+struct spawn_action;
 struct stat;
 struct superblock;
+struct timer;
+struct trap_frame;
 struct vpage_info;
 struct vpi_page;
 struct vregion;
@@ -22,6 +28,9 @@ extern int pages_in_swap;
 extern int free_pages;
 extern int num_page_faults;
 extern int num_disk_reads;
+extern int zero_pages;
+extern int zero_read_faults;
+extern int zero_write_faults;
 
 extern int crashn_enable;
 extern int crashn;
@@ -57,14 +66,18 @@ noreturn void panic(char *);
 
 // exec.c
 int exec(char *, char **);
+int execload(struct vspace *, char *, char **, struct trap_frame *);
 
 // file.c
 int file_open(char *path, int mode);
 int file_close(int fd);
 int file_dup(int fd);
+void file_incref(struct finfo *);
+void file_decref(struct finfo *);
 int file_read(int fd, char* dst, uint n);
 int file_write(int fd, char* src, uint n);
 int file_stat(int fd, struct stat *st);
+struct inode *file_inode(int fd, int writable);
 
 // fs.c
 void readsb(int dev, struct superblock *sb);
@@ -86,8 +99,8 @@ int concurrent_writei(struct inode *, char *, uint, uint);
 int writei(struct inode *, char *, uint, uint);
 int file_create(char *);
 int file_delete(char *);
-void swap_write(char* va, int index);
-void swap_read(char* va, int index);
+void swap_write(char** va, int n, int index);
+void swap_read(char** va, int n, int index);
 
 // ide.c
 void ideinit(void);
@@ -101,17 +114,27 @@ void ioapicinit(void);
 
 // kalloc.c
 struct core_map_entry *pa2page(uint64_t pa);
+uint64_t page2pa(struct core_map_entry *);
 void increment_pp_ref_ct(uint64_t pa);
+int try_increment_pp_ref_ct(uint64_t pa);
 void detect_memory(void);
 char *kalloc(void);
+char *kalloc_pages(int order);
 void kfree(char *);
+void kfree_pages(char *, int order);
+void kmem_pcp_stats(int *hits, int *misses);
 void mem_init(void *);
-void mark_user_mem(uint64_t, uint64_t);
+void mark_user_mem(uint64_t);
 void mark_kernel_mem(uint64_t);
-struct core_map_entry *get_random_user_page();
 int cow_copy_out_page(uint64_t pa, struct vpage_info* curr_page);
-int swap_in(uint on_disk_idx, uint addr);
-void update_swap_ref_ct(int direction, int index);
+int swap_in(uint slot, int n);
+int swap_ra_hit(uint64_t pa);
+void swap_ra_stats(int *pages, int *hits, int *misses);
+void update_swap_ref_ct(int delta, int index);
+void increment_swap_ref_ct(int index);
+void kswapd(void);
+int kswapd_setwmark(int low, int high);
+void kswapd_stats(int *low, int *high, int *pages, int *direct);
 
 // kbd.c
 void kbdintr(void);
@@ -122,6 +145,7 @@ int cpunum(void);
 extern volatile uint *lapic;
 void lapiceoi(void);
 void lapicinit(void);
+void lapicipi(uchar, int);
 void lapicstartap(uchar, uint);
 void microdelay(int);
 
@@ -141,17 +165,31 @@ void                vspaceinstallkern(void);
 void                vspacefree(struct vspace *);
 struct vregion*     va2vregion(struct vspace *, uint64_t);
 struct vpage_info*  va2vpage_info(struct vregion *, uint64_t);
+struct vpage_info*  vregionlookup(struct vregion *, uint64_t);
+struct spinlock*    vpi_lock(struct vpage_info *);
 int                 vregioncontains(struct vregion *, uint64_t, int);
 int                 vspacecopy(struct vspace *, struct vspace *);
 int                 vspaceinitstack(struct vspace *, uint64_t);
 int                 vspacewritetova(struct vspace *, uint64_t, char *, int);
 void                vspacedumpstack(struct vspace *);
 void                vspacedumpcode(struct vspace *);
-int                 vregionaddmap(struct vregion *, uint64_t, uint64_t, short, short);
+int                 vregionaddmap(struct vspace *, struct vregion *, uint64_t, uint64_t, short, short);
 int                 vregiondelmap(struct vregion *, uint64_t, uint64_t);
 int                 vspacemapregions(struct vspace* child, struct vspace* parent);
 int                 vspace_copy_on_write(struct vspace* vs, uint64_t va);
 void                vspacefree_wo_pgtbl(struct vspace *vs);
+void                vspacemove(struct vspace *dst, struct vspace *src);
+int                 vspaceswapin(struct vspace *, uint64_t);
+int                 vspaceupdate(struct vspace *, uint64_t, uint64_t);
+int                 vspaceupdateall(struct vspace *);
+int                 vregionaddzero(struct vregion *, uint64_t, uint64_t);
+int                 vspacemapzero(struct vspace *, uint64_t);
+int                 vspacefillpage(struct vspace *, uint64_t);
+int                 vspacefillrange(struct vspace *, uint64_t, uint64_t);
+struct vregion*     vspaceoverlap(struct vspace *, uint64_t, uint64_t);
+int                 vspacemmap(struct vspace *, uint64_t *, uint64_t, int, int, struct inode *, uint);
+int                 vspacemunmap(struct vspace *, uint64_t, uint64_t);
+int                 vspacemapshm(struct vspace *, uint64_t *, struct shm *, struct vregion *);
 
 // picirq.c
 void picenable(int);
@@ -160,12 +198,18 @@ void picinit(void);
 // proc.c
 void exit(void);
 int fork(void);
+int vfork(void);
+int spawn(char *, char **, struct spawn_action *);
+int vforkdone(struct vspace *);
 int growproc(int);
 int kill(int);
+int nice(int);
 void pinit(void);
 void procdump(void);
 noreturn void scheduler(void);
 void sched(void);
+void schedboost(void);
+int schedtick(void);
 void sleep(void *, struct spinlock *);
 void userinit(void);
 int wait(void);
@@ -173,11 +217,44 @@ void wakeup(void *);
 void yield(void);
 void reboot(void);
 int sbrk(int n);
-int update_vspace(struct core_map_entry* evicting_page, uint va, int swap_array_index, int out, uint ppn);
+struct proc *kthreadcreate(char *name, void (*fn)(void));
+
+// zswap.c
+void zswapinit(void);
+int zswap_store(int slot, char *);
+int zswap_has(int slot);
+int zswap_load(int slot, char *);
+void zswap_invalidate(int slot);
+void zswap_stats(int *pages, int *bytes, int *used, int *size);
+
+// shm.c
+void shminit(void);
+int shmopen(char *, int);
+int64_t shmmap(int, uint64_t);
+int shmunlink(char *);
+void shmdup(struct shm *);
+void shmrelease(struct shm *);
+
+// pcache.c
+void pcacheinit(void);
+char *pcache_get(uint dev, uint inum, uint64_t va);
+int pcache_put(uint dev, uint inum, uint64_t va, char *);
+void pcache_invalidate(uint dev, uint inum);
+void pcache_stats(int *pages, int *hits, int *misses);
 
 // swtch.S
 void swtch(struct context **, struct context *);
 
+// rmap.c
+void rmapinit(void);
+int rmap_add(uint64_t ppn, struct vspace *, uint64_t va, struct vpage_info *);
+void rmap_del(uint64_t ppn, struct vpage_info *);
+int rmap_add_swap(int slot, struct vspace *, uint64_t va, struct vpage_info *);
+int rmap_remove(struct vpage_info *, uint64_t *ppn, int *slot);
+int rmap_test_clear_accessed(struct core_map_entry *);
+int rmap_swap_out(struct core_map_entry *, int slot);
+int rmap_swap_in(int slot, struct core_map_entry *);
+
 // spinlock.c
 void acquire(struct spinlock *);
 void getcallerpcs(void *, uint64_t *);
@@ -212,6 +289,11 @@ int fetchint64_t(uint64_t, int64_t *);
 int fetchstr(uint64_t, char **);
 void syscall(void);
 
+// timer.c
+void timer_add(struct timer *, uint, void (*)(void *), void *);
+int timer_del(struct timer *);
+void timer_tick(void);
+
 // trap.c
 void idtinit(void);
 extern uint ticks;
@@ -11,6 +11,7 @@
 #define DEFAULTBLK 24
 #define LOG_SIZE 32
 #define SWAPSIZE_PAGES 2048
+#define SWAP_CLUSTER 8 // most pages moved to or from swap per disk request
 
 // Disk layout:
 // [ boot block | super block | free bit map |
@@ -0,0 +1,12 @@
+#pragma once
+
+// Arguments to mmap(). A mapping is MAP_SHARED or MAP_PRIVATE, and
+// maps the file open at fd unless MAP_ANON is given.
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+#define MAP_SHARED 0x1  // writes are seen by forked children and reach the file
+#define MAP_PRIVATE 0x2 // writes are copied on write and never reach the file
+#define MAP_ANON 0x4    // zero-filled memory, fd is ignored
+
+#define MAP_FAILED ((void *)-1)
@@ -150,16 +150,24 @@ struct segdesc {
         dpl, 1, (uint)(lim) >> 16, 0, 0, 0, 0, (uint)(base) >> 24              \
   }
 
+// kalloc_pages() hands out runs of 2^order pages, order < KALLOC_MAX_ORDER
+#define KALLOC_MAX_ORDER 10
+
 struct core_map_entry {
   int available;
   int ref_ct;   // number of virtual addresses mapping to this physical memory
   short user;   // 0 if kernel allocated memory, otherwise is user
-  uint64_t va;  // if it is used by kernel only, this field is 0
+  short order;  // log2 of the run length if this page heads a run, else -1
+  uchar ra;     // read ahead from swap and not touched yet
+  struct rmap *rmap;  // the virtual pages mapping this frame (see rmap.c)
+  struct core_map_entry *next;  // free list links, valid while available
+  struct core_map_entry *prev;
 };
 
 struct swap_stat {
   int ref_ct;
-  uchar used;
+  uchar writeback;    // data is still on its way to disk
+  struct rmap *rmap;  // the virtual pages swapped out to this slot
 };
 
 #endif
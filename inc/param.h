@@ -16,3 +16,11 @@
 #define FSSIZE 100000             // size of file system in blocks
 #define MAXCODEPAGES 256
 #define MAXPATHLEN 20
+#define KSWAPD_LOW 64   // free pages under which kswapd starts swapping out
+#define KSWAPD_HIGH 128 // free pages at which kswapd goes back to sleep
+#define ZSWAP_POOL_PAGES 64 // memory set aside for compressed swap (power of 2)
+#define PCACHE_PAGES 32 // program pages kept for sharing between processes
+#define NSHM 8          // shared memory objects
+#define SHMMAXPAGES 64  // pages in one shared memory object
+#define NPRIO 4         // scheduler priority levels
+#define BOOSTTICKS 100  // ticks between priority boosts
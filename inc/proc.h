@@ -14,6 +14,9 @@ struct cpu
   volatile uint started;     // Has the CPU started?
   int ncli;                  // Depth of pushcli nesting.
   int intena;                // Were interrupts enabled before pushcli?
+  pml4e_t *pgtbl;            // User page table installed, or 0
+  volatile uint tlbreq;      // TLB flushes other cpus asked of this one
+  volatile uint tlbdone;     // tlbreq when this cpu last flushed
 
   struct cpu *cpu;
   struct proc *proc;
@@ -24,36 +27,26 @@ extern int ncpu;
 
 // Per-CPU variables, holding pointers to the
 // current cpu and to the current process.
-// The asm suffix tells gcc to use "%gs:0" to refer to cpu
-// and "%gs:4" to refer to proc.  seginit sets up the
-// %gs segment register so that %gs refers to the memory
-// holding those two variables in the local cpu's struct cpu.
-// This is similar to how thread-local variables are implemented
-// in thread libraries such as Linux pthreads.
+// seginit sets up the %gs segment base so that %gs:0
+// refers to cpu and %gs:8 to proc in the local cpu's
+// struct cpu. This is similar to how thread-local
+// variables are implemented in thread libraries such
+// as Linux pthreads.
 
-// static inline struct cpu *
-static struct cpu *mycpu(void)
+static inline struct cpu *mycpu(void)
 {
-  // uint64_t val;
-  // __asm volatile("movq %%gs:0, %0" : "=r" (val));
-  // if (val != 0xffffffff8019a780) {
-  //   while (1) {}
-  // }
-  // return (struct cpu *)val;
+  struct cpu *c;
 
-  // struct cpu* c = &cpus[cpunum()];
-  // return c;
-
-  // single-core for now
-  return &cpus[0];
+  asm volatile("movq %%gs:0, %0" : "=r"(c));
+  return c;
 }
 
 static inline struct proc *myproc(void)
 {
-  // uint64_t val;
-  // __asm volatile("movq %%gs:8, %0" : "=r" (val));
-  // return (struct proc *)val;
-  return mycpu()->proc;
+  struct proc *p;
+
+  asm volatile("movq %%gs:8, %0" : "=r"(p));
+  return p;
 }
 
 // Saved registers for kernel context switches.
@@ -102,6 +95,15 @@ struct proc
   int killed;                // If non-zero, have been killed
   char name[16];             // Process name (debugging)
   struct finfo *fds[NOFILE]; // File Descriptor pointer array
+  int vforked;               // If non-zero, running in the parent's vspace (vfork)
+  struct spinlock lock;      // Protects state while running (see proc.c)
+  int cpu;                   // Cpu whose run queue it goes on
+  struct proc *rqnext;       // Next on that run queue
+  struct proc *chnext;       // Next on its wait channel's queue
+  int prio;                  // Run queue level, 0 runs first
+  int slice;                 // Ticks used at that level
+  int nice;                  // Highest level it may run at
+  uint boostgen;             // Last priority boost it has seen
 };
 
 // Process memory is laid out contiguously, low addresses first:
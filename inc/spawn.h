@@ -0,0 +1,16 @@
+#pragma once
+
+// File actions for spawn(). The child starts with the parent's open
+// files, then the actions are applied to its descriptors in order.
+// A list ends with an action whose op is SPAWN_END.
+#define SPAWN_END 0
+#define SPAWN_DUP 1   // make newfd refer to fd's file, closing newfd first
+#define SPAWN_CLOSE 2 // close fd
+
+#define SPAWN_MAXACT 16 // most actions in one list
+
+struct spawn_action {
+  int op;
+  int fd;
+  int newfd;
+};
@@ -22,3 +22,13 @@
 #define SYS_close 21
 #define SYS_sysinfo 22
 #define SYS_crashn 23
+#define SYS_setwmark 24
+#define SYS_vfork 25
+#define SYS_spawn 26
+#define SYS_mmap 27
+#define SYS_munmap 28
+#define SYS_shm_open 29
+#define SYS_shm_map 30
+#define SYS_shm_unlink 31
+#define SYS_yield 32
+#define SYS_nice 33
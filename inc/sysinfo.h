@@ -6,4 +6,23 @@ struct sys_info {
   int free_pages;
   int num_page_faults;
   int num_disk_reads;
+  int pcp_hits;   // kalloc/kfree calls served by a per-cpu page cache
+  int pcp_misses; // calls that went to the global free lists
+  int wmark_low;  // kswapd starts swapping out under this many free pages
+  int wmark_high; // and stops at this many
+  int kswapd_pages;    // pages swapped out in the background
+  int direct_reclaims; // pages swapped out by kalloc() itself
+  int ra_pages;   // pages swapped in ahead of a fault
+  int ra_hits;    // of which were used
+  int ra_misses;  // of which were evicted or freed unused
+  int zswap_pages;     // swapped-out pages kept compressed in memory
+  int zswap_bytes;     // their compressed size
+  int zswap_pool_used; // bytes of the compressed pool allocated
+  int zswap_pool_size; // bytes in the pool, 0 without CONFIG_ZSWAP
+  int zero_pages;        // heap pages not (yet) backed by their own frame
+  int zero_read_faults;  // faults that mapped the shared zero page
+  int zero_write_faults; // faults that gave a heap page its own frame
+  int pcache_pages;  // program pages cached for sharing
+  int pcache_hits;   // program page faults served from the cache
+  int pcache_misses; // program page faults that read the executable
 };
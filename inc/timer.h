@@ -0,0 +1,11 @@
+#pragma once
+#include <cdefs.h>
+
+// A callback to run at a given tick (see timer.c)
+struct timer {
+  uint expires;          // tick at which fn runs
+  void (*fn)(void *);    // called from the timer interrupt
+  void *arg;
+  int pending;           // added and not yet run or deleted
+  struct timer *next;    // next in its wheel slot
+};
@@ -34,6 +34,7 @@
 #define IRQ_COM1 4
 #define IRQ_IDE 14
 #define IRQ_ERROR 19
+#define IRQ_TLBFLUSH 20 // IPI: flush this cpu's TLB
 #define IRQ_SPURIOUS 31
 
 #ifndef __ASSEMBLER__
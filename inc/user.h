@@ -3,6 +3,7 @@
 struct stat;
 struct rtcdate;
 struct sys_info;
+struct spawn_action;
 
 // system calls
 int fork(void);
@@ -28,6 +29,16 @@ int sleep(int);
 int uptime(void);
 int sysinfo(struct sys_info *);
 int crashn(int);
+int setwmark(int, int);
+int vfork(void);
+int spawn(char *, char **, struct spawn_action *);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int shm_open(char *, int);
+void *shm_map(int, void *);
+int shm_unlink(char *);
+int yield(void);
+int nice(int);
 
 // ulib.c
 int stat(char *, struct stat *);
@@ -42,3 +53,4 @@ void *memset(void *, int, uint);
 void *malloc(uint);
 void free(void *);
 int atoi(const char *);
+uint64_t rdtsc(void);
@@ -4,37 +4,56 @@
 #include <spinlock.h>
 #include <mmu.h>
 
-#define NREGIONS 3
+#define NMMAP 8                // most mmap regions in an address space
+#define NREGIONS (3 + NMMAP)
+#define NVSEGS 8 // most loadable ELF segments in a program
 
 enum {
   VR_CODE   = 0,
   VR_HEAP   = 1,
   VR_USTACK = 2,
+  VR_MMAP   = 3, // first of NMMAP slots, unused while their size is 0
 };
 
+struct shm;
+
 #define VPI_PRESENT  ((short) 1)
 #define VPI_WRITABLE ((short) 1)
 
+// Page descriptor, packed into 8 bytes. Its fields share one word,
+// and a bitfield store rewrites all of it, so once a page has reverse
+// mappings every change to any field is made under the page's
+// striped lock (vpi_lock() in vspace.c). rmap.c takes it too, inside
+// rmaplock, when it moves a page between a frame and a swap slot.
 struct vpage_info {
-  struct spinlock lock;
-  short used;     // whether the page is in use
-  uint64_t ppn;   // physical page number
-  short present;  // whether the page is in physical memory
-  short writable; // does the page have write permissions
+  uint64_t used : 1;          // whether the page is in use
+  uint64_t present : 1;       // whether the page is in physical memory
+  uint64_t writable : 1;      // does the page have write permissions
   // user defined fields
-  short copy_on_write; // tell if the current vpage is RDONLY bc of copy on write
-  uint on_disk;
+  uint64_t copy_on_write : 1; // tell if the current vpage is RDONLY bc of copy on write
+  uint64_t zero : 1;          // demand-zero: maps the shared zero page (once present) until written
+  uint64_t file : 1;          // not read in from its file yet (vspace.segs, or vregion.ip)
+  uint64_t ppn : 40;          // physical page number
+  uint64_t on_disk : 18;      // swap slot, when not present
 };
 
-#define VPIPPAGE ((PGSIZE/sizeof(struct vpage_info)) - 1)
+#define VPI_LEAF   (PGSIZE/sizeof(struct vpage_info)) // vpage_infos per leaf
+#define VPI_FANOUT (PGSIZE/sizeof(void *))            // children per interior node
 #define VRTOP(r) \
   ((r)->dir == VRDIR_UP ? (r)->va_base + (r)->size : (r)->va_base)
 #define VRBOT(r) \
   ((r)->dir == VRDIR_UP ? (r)->va_base : (r)->va_base - (r)->size)
 
+// A region's vpage_infos live in a radix tree indexed by the page's
+// index in the region. Leaves are vpi_pages; above them sit
+// vregion.height levels of vpi_nodes. Subtrees are allocated on first
+// use, and the tree gains a level at the top when the region outgrows it.
 struct vpi_page {
-  struct vpage_info infos[VPIPPAGE];  // info struct for the given page
-  struct vpi_page *next;              // the next page
+  struct vpage_info infos[VPI_LEAF];  // info struct for the given page
+};
+
+struct vpi_node {
+  void *child[VPI_FANOUT];  // vpi_nodes, or vpi_pages on the lowest level
 };
 
 enum vr_direction {
@@ -46,11 +65,41 @@ struct vregion {
   enum vr_direction dir;  // direction of growth
   uint64_t va_base;       // base of the region
   uint64_t size;          // size of region in bytes
-  struct vpi_page *pages;  // pointer to array of page_infos
+  void *root;             // radix tree of page_infos
+  int height;             // levels of vpi_nodes above the leaves
+  int prot;               // mmap regions: PROT_* bits
+  int flags;              // mmap regions: MAP_* bits, 0 for the others
+  struct inode *ip;       // file an mmap region maps, or 0
+  uint off;               // where the region starts in it
+  struct shm *shm;        // shared memory object an mmap region maps, or 0
+};
+
+// A loadable segment of the executable. The code region's pages are
+// read in from these on first touch instead of at exec.
+struct vseg {
+  uint64_t va;     // where the segment starts, page aligned
+  uint64_t filesz; // bytes that come from the file
+  uint64_t memsz;  // bytes in memory; those past filesz are zero
+  uint off;        // where the segment starts in the file
 };
 
 struct vspace {
   struct vregion regions[NREGIONS]; // the regions for a process' virtual space
   pml4e_t* pgtbl;                   // process' page table
+  int ra_window;                    // pages swapped in per fault (readahead)
+  int ra_last;                      // pages read ahead by the last fault
+  int ra_hits;                      // of which were touched since
+  struct inode *ip;                 // executable the code is paged in from, or 0
+  struct vseg segs[NVSEGS];         // its loadable segments
+  int nsegs;
+};
+
+// reverse mapping entry: vpi, at va in the address space with page
+// table pgtbl, refers to a frame or swap slot
+struct rmap {
+  pml4e_t *pgtbl;
+  uint64_t va;
+  struct vpage_info *vpi;
+  struct rmap *next;
 };
 
@@ -10,3 +10,5 @@ int       allocuvm(pml4e_t*, char*, uint64_t, uint64_t);
 int       deallocuvm(pml4e_t*, char*, uint64_t, uint64_t);
 void      freevm_pdpt(pdpte_t *pdpt);
 void      freevm(pml4e_t*);
+void      tlbshootdown(pml4e_t*, uint64_t);
+void      tlbflushack(void);
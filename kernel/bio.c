@@ -96,7 +96,7 @@ static struct buf *bget(uint dev, uint blockno) {
 
 // Return a locked buf with the contents of the indicated block.
 struct buf *bread(uint dev, uint blockno) {
-  num_disk_reads += 1;
+  __sync_fetch_and_add(&num_disk_reads, 1);
   struct buf *b;
 
   b = bget(dev, blockno);
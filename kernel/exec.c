@@ -8,69 +8,83 @@
 #include <trap.h>
 #include <x86_64vm.h>
 
-static uint64_t get_addr_and_copy(struct vspace vs, uint64_t addr, char* data, int data_size);
-
-int exec(char *path, char **argv) {
+static uint64_t get_addr_and_copy(struct vspace *vs, uint64_t addr, char* data, int data_size);
+
+// Builds in vs, which has just been through vspaceinit, the address
+// space that runs the program at path with the arguments in the user
+// array argv, read from the current process, and points tf at its
+// entry point, stack and arguments. On failure returns -1 and leaves
+// vs for the caller to free.
+int execload(struct vspace *vs, char *path, char **argv, struct trap_frame *tf) {
   // 1. get argc and validated version of argv,
-  // the reason is to get argc for step 5 to use (step 5 needs backward alignment)
+  // the reason is to get argc for step 4 to use (step 4 needs backward alignment)
   // for example, ['ls', null] has argc 2
+  // The strings stay in the caller's memory, but the pointers are
+  // copied, so that the caller's argv is left as it was.
   int argc = 0;
   uint64_t arg_addr = (uint64_t) argv;
-  char** args = argv;
+  char* args[MAXARG + 1];
   for (; argc <= MAXARG; argc++) {  // Q: why while loop doesn't work
     uint64_t str_addr;
     // validate and use arg addr to get string addr (the starting addr of the string)
     if (fetchint64_t(arg_addr, (int64_t*)&str_addr) == -1) return -1;
+    if (str_addr == 0) {
+      args[argc] = NULL;
+      break;
+    }
     // validate and get string itself
     if (fetchstr(str_addr, &args[argc]) == -1 ) return -1;
-    if (args[argc] == NULL) break;
     arg_addr += sizeof(char*);  // loop through every addr in argv
   }
+  if (argc > MAXARG) return -1;
   argc++;
-  if (strncmp(args[0], path, strlen(path))) return -1;
+  if (argc < 2 || strncmp(args[0], path, strlen(path))) return -1;
 
-  // 2. establish a (mock) new vspace for the current process,
-  // if everthing goes well, we will replace it with the current one.
-  // This is a design decision: if anything goes wrong in the process of setting up
-  // this new vspace, we won't miss up the current vspace
-  struct vspace vs;
-  if (vspaceinit(&vs) != 0) {
-    vspacefree(&vs);
+  // 2. load the program
+  if (vspaceloadcode(vs, path, &tf->rip) == 0)
     return -1;
-  }
 
-  // 3. load the program
-  //uint64_t first_instruction;
-  if (vspaceloadcode(&vs, path, &myproc()->tf->rip) == 0) {
-    vspacefree(&vs);
-    return -1;
-  }
-
-  // 4. initialize user stack
+  // 3. initialize user stack
   uint64_t addr = SZ_2G; // also vs.regions[VR_USTACK].va_base
-  if (vspaceinitstack(&vs, addr) != 0) {
-    vspacefree(&vs);
+  if (vspaceinitstack(vs, addr) != 0)
     return -1;
-  }
 
-  // 5. set arguments to user stack
+  // 4. set arguments to user stack
   int idx = argc - 2;
   while (idx >= 0) {
-    addr = get_addr_and_copy(vs, addr, args[idx], strlen(args[idx]) + 1);
+    if ((addr = get_addr_and_copy(vs, addr, args[idx], strlen(args[idx]) + 1)) == -1)
+      return -1;
     // correcting the address stored in current stack, based on our alignment
     args[idx] = (char*)addr;
     idx--;
   }
 
-  // 6. copy over args
-  addr = get_addr_and_copy(vs, addr, (char*)args, argc * sizeof(char*));
+  // 5. copy over args
+  if ((addr = get_addr_and_copy(vs, addr, (char*)args, argc * sizeof(char*))) == -1)
+    return -1;
 
-  struct proc* p = myproc();
+  // 6. set rdi and rsi for main
+  tf->rdi = argc - 1;  // arg0 -> argc for main
+  tf->rsi = addr;  // arg1 -> argv for main
+  tf->rsp = addr - sizeof(char*);  // bottom of the stack
+  return 0;
+}
 
-  // 7. set rdi and rsi for main
-  p->tf->rdi = argc - 1;  // arg0 -> argc for main
-  p->tf->rsi = addr;  // arg1 -> argv for main
-  p->tf->rsp = addr - sizeof(char*);  // bottom of the stack
+int exec(char *path, char **argv) {
+  // 7. establish a (mock) new vspace for the current process,
+  // if everthing goes well, we will replace it with the current one.
+  // This is a design decision: if anything goes wrong in the process of setting up
+  // this new vspace, we won't miss up the current vspace
+  struct vspace vs;
+  struct proc* p = myproc();
+  if (vspaceinit(&vs) != 0) {
+    vspacefree(&vs);
+    return -1;
+  }
+  if (execload(&vs, path, argv, p->tf) != 0) {
+    vspacefree(&vs);
+    return -1;
+  }
 
   // 8. copying vs over to current process and install the process
   // if (vspacecopy(&p->vspace, &vs) != 0) {
@@ -80,10 +94,13 @@ int exec(char *path, char **argv) {
   // vspacefree(&vs);
   // vspaceinstall(p);
 
-  struct vspace old_vs = p->vspace;
-  p->vspace = vs;
+  struct vspace old_vs;
+  vspacemove(&old_vs, &p->vspace);
+  vspacemove(&p->vspace, &vs);
   vspaceinstall(p);
-  vspacefree(&old_vs);
+  // it was only borrowed, unless the vfork parent has exited since
+  if (!p->vforked || vforkdone(&old_vs) < 0)
+    vspacefree(&old_vs);
 
   // pml4e_t* pgtbl = p->vspace.pgtbl;
   // vspacefree_wo_pgtbl(&p->vspace);
@@ -115,16 +132,16 @@ int exec(char *path, char **argv) {
   return 0;
 }
 
-static uint64_t get_addr_and_copy(struct vspace vs, uint64_t addr, char* data, int data_size) {
+// copies data_size bytes of data to the top of the stack below addr,
+// returning the aligned address it went to, or -1
+static uint64_t get_addr_and_copy(struct vspace *vs, uint64_t addr, char* data, int data_size) {
   // update addr
   addr -= data_size;
   // make alignment
   while (addr % sizeof(char*) != 0) addr--;
   // copy over
-  if (vspacewritetova(&vs, addr, data, data_size) != 0) {
-    vspacefree(&vs);
+  if (vspacewritetova(vs, addr, data, data_size) != 0)
     return -1;
-  }
 
   return addr;
 }
@@ -10,6 +10,7 @@
 #include <param.h>
 #include <sleeplock.h>
 #include <spinlock.h>
+#include <stat.h>
 #include <proc.h>
 
 struct devsw devsw[NDEV];
@@ -157,6 +158,33 @@ int file_close(int fd)
 
   // close the connection between finfo and the current process;
   process->fds[fd] = NULL;
+  file_decref(file);
+  return 0;
+}
+
+// takes another reference to file, for a descriptor being copied
+// into another process
+void file_incref(struct finfo *file)
+{
+  acquire(&ftable.lock);
+  file->ref_ct++;
+  release(&ftable.lock);
+  if (file->type == PIPE) {
+    struct pipe* curr_pipe = (struct pipe*) file->ip;
+    acquire(&curr_pipe->lock);
+    if (file->access_permi == O_RDONLY) {
+      curr_pipe->read_ref_ct++;
+    } else {
+      curr_pipe->write_ref_ct++;
+    }
+    release(&curr_pipe->lock);
+  }
+}
+
+// drops a reference to file taken by a descriptor that was just
+// cleared, and cleans the file up when it was the last
+void file_decref(struct finfo *file)
+{
   acquire(&ftable.lock);
   file->ref_ct--;
   release(&ftable.lock);
@@ -187,7 +215,6 @@ int file_close(int fd)
     file->offset = 0;
     release(&ftable.lock);
   }
-  return 0;
 }
 
 int file_dup(int fd)
@@ -400,6 +427,28 @@ int file_stat(int fd, struct stat *st)
   return 0;
 }
 
+// Returns a new reference to the inode of the regular file open at
+// fd, for mapping it into memory, or 0 if fd is not a file open for
+// reading (and for writing too, if writable is set).
+struct inode *file_inode(int fd, int writable)
+{
+  struct finfo *file = myproc()->fds[fd];
+  struct inode *ip;
+  int mode;
+
+  if (file == NULL || file->type != FILE)
+    return 0;
+  mode = file->access_permi & 3;
+  if (mode != O_RDONLY && mode != O_RDWR)
+    return 0;
+  if (writable && mode != O_RDWR)
+    return 0;
+  ip = (struct inode*)file->ip;
+  if (ip->type != T_FILE)
+    return 0;
+  return idup(ip);
+}
+
 static int fd_available()
 {
   int fd;
@@ -82,6 +82,11 @@ static void copy_to_disk();
 static void log_commit();
 static void log_check();
 
+// The descriptor all swap I/O goes through, rather than one on the
+// caller's kernel stack. Its sleeplock lets one swap request at a
+// time use it; the disk serves them one at a time anyway.
+static struct buf swapbuf;
+
 // Find the inode file on the disk and load it into memory
 // should only be called once, but is idempotent.
 static void init_inodefile(int dev) {
@@ -112,6 +117,7 @@ void iinit(int dev) {
     initsleeplock(&icache.inode[i].lock, "inode");
   }
   initsleeplock(&icache.inodefile.lock, "inodefile");
+  initsleeplock(&swapbuf.lock, "swap");
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d log start %d swap start %d bmap start %d inodestart %d\n", sb.size,
@@ -329,6 +335,8 @@ int writei(struct inode *ip, char *src, uint off, uint n) {
       return -1;
     return devsw[ip->devid].write(ip, src, n);
   }
+  // programs must not keep running the old contents
+  pcache_invalidate(ip->dev, ip->inum);
   if (ip->inum > ROOTINO) {
     locki(&icache.inodefile);
   }
@@ -677,6 +685,8 @@ int file_delete(char* path) {
     // copy_to_disk();
   }
   unlocki(&icache.inodefile);
+  // the inode number may be reused for another file
+  pcache_invalidate(ip->dev, ip->inum);
   return 0;
 }
 
@@ -784,29 +794,32 @@ static void log_check() {
 
 
 //----------------------------swap section---------------------------------------------
-// va: kernel virtual address of the start of the evicitng page
-// index: index of 8 blocks that are going to be written
-void swap_write(char* va, int index) {
-  uint block_no = sb.swapstart + index * 8;
-  uint limit = block_no + 8;
-  struct buf* buffer;
-  for (; block_no < limit; block_no++, va+=BSIZE) {
-    buffer = bread(ROOTDEV, block_no);
-    memmove(buffer->data, va, BSIZE);
-    bwrite(buffer);
-    brelse(buffer);
-  }
-}
-
-// va: kernel virtual address of the start of the loading page
-// index: index of 8 blocks that are going to be read from
-void swap_read(char* va, int index) {
-  uint block_no = sb.swapstart + index * 8;
-  uint limit = block_no + 8;
-  struct buf* buffer;
-  for (; block_no < limit; block_no++, va+=BSIZE) {
-    buffer = bread(ROOTDEV, block_no);
-    memmove(va, buffer->data, BSIZE);
-    brelse(buffer);
-  }
+// Moves n pages between va[] and the n contiguous swap slots
+// starting at index, as a single multi-sector disk request that
+// does not go through the buffer cache. May sleep.
+static void swap_rw(char** va, int n, int index, int flags) {
+  struct buf* b = &swapbuf;
+
+  acquiresleep(&b->lock);
+  b->dev = ROOTDEV;
+  b->blockno = sb.swapstart + index * (PGSIZE / BSIZE);
+  b->flags = flags;
+  b->pages = va;
+  b->npages = n;
+  iderw(b);
+  releasesleep(&b->lock);
+}
+
+// va: kernel virtual addresses of the n pages being evicted
+// index: first of the n swap slots they are written to
+void swap_write(char** va, int n, int index) {
+  swap_rw(va, n, index, B_DIRTY);
+}
+
+// va: kernel virtual addresses of the n pages being loaded
+// index: first of the n swap slots they are read from
+void swap_read(char** va, int n, int index) {
+  // counted in blocks, as bread() counts them
+  __sync_fetch_and_add(&num_disk_reads, n * (PGSIZE / BSIZE));
+  swap_rw(va, n, index, 0);
 }
\ No newline at end of file
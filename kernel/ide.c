@@ -67,30 +67,46 @@ void ideinit(void) {
   outb(0x1f6, 0xe0 | (0 << 4));
 }
 
+// returns the kernel address of sector i of a swap request
+static void *swapsector(struct buf *b, int i) {
+  int per_page = PGSIZE / SECTOR_SIZE;
+
+  return b->pages[i / per_page] + (i % per_page) * SECTOR_SIZE;
+}
+
 // Start the request for b.  Caller must hold idelock.
+// A swap request transfers all its sectors with one command, and the
+// disk interrupts once per sector.
 static void idestart(struct buf *b) {
   if (b == 0)
     panic("idestart");
-  if (b->blockno >= FSSIZE)
-    panic("incorrect blockno");
   int sector_per_block = BSIZE / SECTOR_SIZE;
+  int nsect = b->pages ? b->npages * (PGSIZE / SECTOR_SIZE) : sector_per_block;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ : IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int read_cmd = (nsect == 1 || b->pages) ? IDE_CMD_READ : IDE_CMD_RDMUL;
+  int write_cmd = (nsect == 1 || b->pages) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
-  if (sector_per_block > 7)
+  if (b->blockno + nsect / sector_per_block > FSSIZE)
+    panic("incorrect blockno");
+  if (sector_per_block > 7 || nsect > 255)
     panic("idestart");
 
+  b->sectdone = 0;
   idewait(0);
   outb(0x3f6, 0);                // generate interrupt
-  outb(0x1f2, sector_per_block); // number of sectors
+  outb(0x1f2, nsect);            // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev & 1) << 4) | ((sector >> 24) & 0x0f));
   if (b->flags & B_DIRTY) {
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE / 4);
+    if (b->pages) {
+      idewait(0);
+      outsl(0x1f0, swapsector(b, b->sectdone++), SECTOR_SIZE / 4);
+    } else {
+      outsl(0x1f0, b->data, BSIZE / 4);
+    }
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -107,10 +123,29 @@ void ideintr(void) {
     // cprintf("spurious IDE interrupt\n");
     return;
   }
+
+  // Move the next sector of a swap request, until all are done.
+  if (b->pages) {
+    if (b->flags & B_DIRTY) {
+      if (b->sectdone < b->npages * (PGSIZE / SECTOR_SIZE)) {
+        idewait(0);
+        outsl(0x1f0, swapsector(b, b->sectdone++), SECTOR_SIZE / 4);
+        release(&idelock);
+        return;
+      }
+    } else {
+      if (idewait(1) >= 0)
+        insl(0x1f0, swapsector(b, b->sectdone), SECTOR_SIZE / 4);
+      if (++b->sectdone < b->npages * (PGSIZE / SECTOR_SIZE)) {
+        release(&idelock);
+        return;
+      }
+    }
+  }
   idequeue = b->qnext;
 
   // Read data if needed.
-  if (!(b->flags & B_DIRTY) && idewait(1) >= 0)
+  if (!b->pages && !(b->flags & B_DIRTY) && idewait(1) >= 0)
     insl(0x1f0, b->data, BSIZE / 4);
 
   // Wake process waiting for this buf.
@@ -63,10 +63,51 @@ struct swap_stat swap_status[SWAPSIZE_PAGES]; // 1 byte = 8 blocks -> 1 page
 struct {
   struct spinlock lock;
   int use_lock;
+  // free_area[k] lists the free runs of exactly 2^k pages (binary buddy)
+  struct core_map_entry *free_area[KALLOC_MAX_ORDER];
 } kmem;
 
-static void setrand(unsigned int);
-static int swap_out();
+// Per-CPU caches of free pages sitting in front of the buddy lists.
+// kalloc() and kfree() only touch the cache of the cpu they run on,
+// and go to kmem.lock just to move PCP_BATCH pages at a time between
+// a cache and the buddy lists. Each cache has a lock of its own, which
+// other cpus take only when kalloc() finds memory exhausted and puts
+// every cached page back (see pcp_drain_all), so it is normally
+// uncontended. It comes before kmem.lock: with kmem.lock held,
+// kalloc() and kfree() bypass the caches. Cached pages count as
+// free in free_pages; they are marked available but, with order -1,
+// are never mistaken for the head of a free buddy run.
+#define PCP_HIGH 16 // most pages a cpu's cache holds
+#define PCP_BATCH 8 // pages moved per refill or drain
+
+struct kmem_pcp {
+  struct spinlock lock;
+  struct core_map_entry *pages[PCP_HIGH];
+  int n;        // number of cached pages
+  uint hits;    // kalloc()/kfree() calls served by the cache alone
+  uint misses;  // calls that had to refill or drain through kmem.lock
+};
+
+static struct kmem_pcp kmem_pcp[NCPU];
+
+// Background reclaim. kswapd sleeps until free_pages drops under
+// kswapd_low, then swaps out until it is back at kswapd_high, so that
+// kalloc() only has to swap out itself (a direct reclaim) when kswapd
+// falls behind. All of this is protected by kmem.lock.
+static int kswapd_low = KSWAPD_LOW;
+static int kswapd_high = KSWAPD_HIGH;
+static int kswapd_awake = 1; // until kswapd first goes to sleep
+static int kswapd_pages;     // pages swapped out by kswapd
+static int direct_reclaims;  // pages swapped out by kalloc() itself
+
+// Swap readahead counters, see swap_in().
+static int ra_pages;  // pages read in beyond the one faulted on
+static int ra_hits;   // read-ahead pages that were then touched
+static int ra_misses; // read-ahead pages evicted or freed untouched
+
+static int swap_out(int n);
+static void kswapd_poke(void);
+static void buddy_free(struct core_map_entry *r, int order);
 
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
@@ -75,6 +116,7 @@ static int swap_out();
 // after installing a full page table that maps them on all cores.
 void mem_init(void *vstart) {
   void *vend;
+  int i;
 
   core_map = vstart;
   memset(vstart, 0, PGROUNDUP(npages * sizeof(struct core_map_entry)));
@@ -82,32 +124,125 @@ void mem_init(void *vstart) {
 
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 1;
+  for (i = 0; i < NCPU; i++)
+    initlock(&kmem_pcp[i].lock, "kmem_pcp");
 
   vend = (void *)P2V((uint64_t)(npages * PGSIZE));
-  freerange(vstart, vend);
-  free_pages = (vend - vstart) >> PT_SHIFT;
+  free_pages = 0;
   pages_in_use = 0;
   pages_in_swap = 0;
-  kmem.use_lock = 1;
-  setrand(1);
+  acquire(&kmem.lock);
+  freerange(vstart, vend);
+  release(&kmem.lock);
 }
 
+// Hands every whole page in [vstart, vend) to the allocator.
+// Caller must hold kmem.lock.
 void freerange(void *vstart, void *vend) {
   char *p;
   p = (char *)PGROUNDUP((uint64_t)vstart);
-  for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
-    kfree(p);
+  for (; p + PGSIZE <= (char *)vend; p += PGSIZE) {
+    buddy_free(pa2page(V2P(p)), 0);
+    free_pages++;
+  }
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void kfree(char *v) {
+// returns the buddy of the run of 2^order pages headed by r,
+// or 0 if the buddy would lie past the end of physical memory
+static struct core_map_entry *buddy_of(struct core_map_entry *r, int order) {
+  uint64_t idx = (r - core_map) ^ (1 << order);
+
+  if (idx >= npages)
+    return 0;
+  return &core_map[idx];
+}
+
+static void freelist_push(struct core_map_entry *r, int order) {
+  r->order = order;
+  r->prev = 0;
+  r->next = kmem.free_area[order];
+  if (r->next)
+    r->next->prev = r;
+  kmem.free_area[order] = r;
+}
+
+static void freelist_remove(struct core_map_entry *r, int order) {
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.free_area[order] = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  r->next = 0;
+  r->prev = 0;
+}
+
+// Puts the run of 2^order pages headed by r back on the free lists,
+// merging it with its buddy for as long as the buddy is free as well.
+// Caller must hold kmem.lock.
+static void buddy_free(struct core_map_entry *r, int order) {
+  struct core_map_entry *b;
+  int i;
+
+  for (i = 0; i < (1 << order); i++) {
+    r[i].available = 1;
+    r[i].ref_ct = 0;
+    r[i].user = 0;
+    r[i].rmap = 0;
+    r[i].order = -1;
+  }
+
+  while (order < KALLOC_MAX_ORDER - 1) {
+    b = buddy_of(r, order);
+    if (!b || !b->available || b->order != order)
+      break;
+    freelist_remove(b, order);
+    b->order = -1;
+    if (b < r)
+      r = b;
+    order++;
+  }
+  freelist_push(r, order);
+}
+
+// Takes a run of 2^order pages off the free lists, splitting the
+// smallest larger run when there is no exact fit.
+// Caller must hold kmem.lock.
+static struct core_map_entry *buddy_alloc(int order) {
+  struct core_map_entry *r;
+  int k, i;
+
+  for (k = order; k < KALLOC_MAX_ORDER; k++) {
+    if (kmem.free_area[k])
+      break;
+  }
+  if (k == KALLOC_MAX_ORDER)
+    return 0;
+
+  r = kmem.free_area[k];
+  freelist_remove(r, k);
+  // give back the upper halves until the run is the requested size
+  while (k > order) {
+    k--;
+    freelist_push(r + (1 << k), k);
+  }
+
+  for (i = 0; i < (1 << order); i++) {
+    r[i].available = 0;
+    r[i].order = -1;
+  }
+  r->order = order;
+  return r;
+}
+
+// Free the run of 2^order pages of physical memory pointed at by v,
+// which normally should have been returned by a call to kalloc_pages().
+void kfree_pages(char *v, int order) {
   struct core_map_entry *r;
   uint lock = 0;
 
-  if ((uint64_t)v % PGSIZE || v < _end || V2P(v) >= (uint64_t)(npages * PGSIZE))
+  if (order < 0 || order >= KALLOC_MAX_ORDER || V2P(v) % (PGSIZE << order) ||
+      v < _end || V2P(v) + (PGSIZE << order) > (uint64_t)(npages * PGSIZE))
     panic("kfree");
 
   if (kmem.use_lock && !holding(&kmem.lock)) {
@@ -116,226 +251,594 @@ void kfree(char *v) {
   }
 
   r = (struct core_map_entry *)pa2page(V2P(v));
-  if (r->ref_ct > 1) {
-    r->ref_ct--;
-    if (kmem.use_lock)
+  if (r->available || r->order != order)
+    panic("kfree: not an allocated run");
+  if (__sync_sub_and_fetch(&r->ref_ct, 1) > 0) {
+    if (lock)
       release(&kmem.lock);
     return;
   }
+  __sync_fetch_and_sub(&pages_in_use, 1 << order);
+  __sync_fetch_and_add(&free_pages, 1 << order);
+
+  // Fill with junk to catch dangling refs.
+  memset(v, 2, PGSIZE << order);
+
+  buddy_free(r, order);
+  if (lock)
+    release(&kmem.lock);
+}
+
+// Moves up to PCP_BATCH pages from the buddy lists into c.
+// Caller must hold c->lock.
+static void pcp_refill(struct kmem_pcp *c) {
+  struct core_map_entry *r;
+  int lock = 0;
+
+  if (kmem.use_lock && !holding(&kmem.lock)) {
+    acquire(&kmem.lock);
+    lock = 1;
+  }
+  while (c->n < PCP_BATCH && (r = buddy_alloc(0)) != 0) {
+    r->available = 1;
+    r->order = -1;
+    c->pages[c->n++] = r;
+  }
+  if (lock)
+    release(&kmem.lock);
+}
+
+// Returns PCP_BATCH pages from c to the buddy lists.
+// Caller must hold c->lock.
+static void pcp_drain(struct kmem_pcp *c) {
+  int i;
+  int lock = 0;
+
+  if (kmem.use_lock && !holding(&kmem.lock)) {
+    acquire(&kmem.lock);
+    lock = 1;
+  }
+  for (i = 0; i < PCP_BATCH && c->n > 0; i++)
+    buddy_free(c->pages[--c->n], 0);
+  if (lock)
+    release(&kmem.lock);
+}
+
+// Returns every page cached by any cpu to the buddy lists, so that
+// an allocation short of memory does not reclaim, or fail, while
+// other cpus sit on free pages. Must not be called with kmem.lock held.
+static void pcp_drain_all(void) {
+  struct kmem_pcp *c;
+
+  for (c = kmem_pcp; c < &kmem_pcp[NCPU]; c++) {
+    acquire(&c->lock);
+    while (c->n > 0)
+      pcp_drain(c);
+    release(&c->lock);
+  }
+}
+
+// Free the page of physical memory pointed at by v,
+// which normally should have been returned by a
+// call to kalloc(). The page goes to this cpu's cache.
+void kfree(char *v) {
+  struct core_map_entry *r;
+  struct kmem_pcp *c;
+
+  if ((uint64_t)v % PGSIZE || v < _end || V2P(v) >= (uint64_t)(npages * PGSIZE))
+    panic("kfree");
+
+  r = (struct core_map_entry *)pa2page(V2P(v));
+  if (r->available || r->order != 0)
+    panic("kfree: not an allocated page");
+  if (__sync_sub_and_fetch(&r->ref_ct, 1) > 0)
+    return;
+  if (r->rmap)
+    panic("kfree: page still mapped");
+  if (r->ra) {
+    r->ra = 0;
+    __sync_fetch_and_add(&ra_misses, 1);
+  }
   r->ref_ct = 0;
-  pages_in_use--;
-  free_pages++;
+  r->user = 0;
 
   // Fill with junk to catch dangling refs.
   memset(v, 2, PGSIZE);
 
+  __sync_fetch_and_sub(&pages_in_use, 1);
+  __sync_fetch_and_add(&free_pages, 1);
+
+  if (kmem.use_lock && holding(&kmem.lock)) {
+    buddy_free(r, 0);
+    return;
+  }
+
+  pushcli();
+  c = &kmem_pcp[mycpu() - cpus];
+  acquire(&c->lock);
+  if (c->n == PCP_HIGH) {
+    c->misses++;
+    pcp_drain(c);
+  } else {
+    c->hits++;
+  }
   r->available = 1;
-  r->user = 0;
-  r->va = 0;
-  if (kmem.use_lock && lock)
-    release(&kmem.lock);
+  r->order = -1;
+  c->pages[c->n++] = r;
+  release(&c->lock);
+  popcli();
+}
+
+// Sums the per-CPU cache counters for sysinfo.
+void kmem_pcp_stats(int *hits, int *misses) {
+  struct kmem_pcp *c;
+
+  *hits = 0;
+  *misses = 0;
+  for (c = kmem_pcp; c < &kmem_pcp[NCPU]; c++) {
+    *hits += c->hits;
+    *misses += c->misses;
+  }
 }
 
 void
-mark_user_mem(uint64_t pa, uint64_t va)
+mark_user_mem(uint64_t pa)
 {
-  // for user mem, add an mapping to proc_info
+  // the frame backs user memory; rmap says who maps it
   struct core_map_entry *r = pa2page(pa);
 
   r->user = 1;
-  r->va = va;
 }
 
 void
 mark_kernel_mem(uint64_t pa)
 {
-  // for user mem, add an mapping to proc_info
   struct core_map_entry *r = pa2page(pa);
 
   r->user = 0;
-  r->va = 0;
 }
 
-char *kalloc(void) {
-
-  int i;
+// Allocates a physically contiguous run of 2^order pages, aligned
+// to its own size. Returns 0 if no run that large is free; unlike
+// kalloc() this never swaps to make room.
+char *kalloc_pages(int order) {
+  struct core_map_entry *r;
   int lock = 0;
 
+  if (order < 0 || order >= KALLOC_MAX_ORDER)
+    return 0;
+
   if (kmem.use_lock && !holding(&kmem.lock)) {
     acquire(&kmem.lock);
     lock = 1;
   }
 
-  for (i = 0; i < npages; i++) {
-    if (core_map[i].available == 1) {
-      core_map[i].available = 0;
-      core_map[i].ref_ct = 1;
-      pages_in_use++;
-      free_pages--;
-      if (kmem.use_lock && lock)
-        release(&kmem.lock);
-      return P2V(page2pa(&core_map[i]));
+  if ((r = buddy_alloc(order)) != 0) {
+    r->ref_ct = 1;
+    __sync_fetch_and_add(&pages_in_use, 1 << order);
+    __sync_fetch_and_sub(&free_pages, 1 << order);
+  }
+
+  if (lock)
+    release(&kmem.lock);
+  return r ? P2V(page2pa(r)) : 0;
+}
+
+// Allocate one 4096-byte page of physical memory.
+// Returns a pointer that the kernel can use.
+// Pages come from this cpu's cache; when both the cache and
+// the buddy lists are empty the other cpus' caches are emptied,
+// then a user page is swapped out to make room, and 0 is
+// returned if even that fails.
+char *kalloc(void) {
+  struct core_map_entry *r = 0;
+  struct kmem_pcp *c;
+  char *v;
+  int lock = 0;
+
+  if (!kmem.use_lock || !holding(&kmem.lock)) {
+    pushcli();
+    c = &kmem_pcp[mycpu() - cpus];
+    acquire(&c->lock);
+    if (c->n == 0) {
+      c->misses++;
+      pcp_refill(c);
+    } else {
+      c->hits++;
     }
+    if (c->n > 0)
+      r = c->pages[--c->n];
+    release(&c->lock);
+    popcli();
   }
 
-  if (swap_out() == 0) {
-    if (kmem.use_lock && lock)
-      release(&kmem.lock);
-    return 0;
-  } else {
-    if (kmem.use_lock && lock)
-      release(&kmem.lock);
-    return kalloc();
+  if (r) {
+    r->available = 0;
+    r->order = 0;
+    r->ref_ct = 1;
+    __sync_fetch_and_add(&pages_in_use, 1);
+    __sync_fetch_and_sub(&free_pages, 1);
+    kswapd_poke();
+    return P2V(page2pa(r));
   }
-}
 
+  if (kmem.use_lock && !holding(&kmem.lock)) {
+    pcp_drain_all();
+    acquire(&kmem.lock);
+    lock = 1;
+  }
 
-static unsigned long int next = 1;
+  while ((v = kalloc_pages(0)) == 0) {
+    if (swap_out(1) == 0)
+      break;
+    __sync_fetch_and_add(&direct_reclaims, 1);
+  }
 
-// returns random integer from [0, limit)
-static int rand(int limit) {
-  next = next * 1103515245 + 12345;
-  return (unsigned int)(next/65536) % limit;
+  if (kmem.use_lock && lock)
+    release(&kmem.lock);
+  kswapd_poke();
+  return v;
 }
 
-// Sets the seed for random.
-// Intended to be used before calling rand.
-static void setrand(unsigned int seed) {
-  next = seed;
+// Wakes kswapd when free memory falls under the low watermark.
+// The first test is made without the lock, to keep it off the
+// allocation path; at worst it misses kswapd just going to sleep,
+// and a later call wakes it. kswapd_awake itself only changes under
+// kmem.lock, which kswapd sleeps on, so the wakeup cannot be lost.
+static void kswapd_poke(void) {
+  int lock = 0;
+
+  if (free_pages >= kswapd_low || kswapd_awake)
+    return;
+  if (kmem.use_lock && !holding(&kmem.lock)) {
+    acquire(&kmem.lock);
+    lock = 1;
+  }
+  if (!kswapd_awake && free_pages < kswapd_low) {
+    kswapd_awake = 1;
+    wakeup(&kswapd_awake);
+  }
+  if (lock)
+    release(&kmem.lock);
 }
 
-struct core_map_entry * get_random_user_page() {
-  int x = 100;
-  while(x--) {
-    int rand_index = rand(npages);
-    if (core_map[rand_index].va != 0) {
-      return &core_map[rand_index];
+// Reclaim thread, started by main. Swaps out in batches, from
+// whenever free_pages drops under kswapd_low until it reaches
+// kswapd_high or there is nothing left to evict.
+void kswapd(void) {
+  int n;
+
+  acquire(&kmem.lock);
+  for (;;) {
+    while (free_pages < kswapd_high) {
+      if ((n = swap_out(kswapd_high - free_pages)) == 0)
+        break;
+      __sync_fetch_and_add(&kswapd_pages, n);
     }
+    kswapd_awake = 0;
+    sleep(&kswapd_awake, &kmem.lock);
   }
-  panic("Tried 100 random indices for random user page, all failed");
+}
+
+// Sets the watermarks kswapd works between, in free pages.
+// Returns -1 if they are out of order or larger than memory.
+int kswapd_setwmark(int low, int high) {
+  if (low < 0 || high < low || high > npages)
+    return -1;
+  acquire(&kmem.lock);
+  kswapd_low = low;
+  kswapd_high = high;
+  release(&kmem.lock);
+  kswapd_poke();
+  return 0;
+}
+
+// Reports the watermarks and reclaim counters for sysinfo.
+void kswapd_stats(int *low, int *high, int *pages, int *direct) {
+  *low = kswapd_low;
+  *high = kswapd_high;
+  *pages = kswapd_pages;
+  *direct = direct_reclaims;
+}
+
+
+static int clock_hand; // next core_map index the clock looks at
+
+// Picks the frame to evict with the clock (second-chance) algorithm.
+// The hand sweeps core_map over mapped user frames; a frame that some
+// process touched since the last sweep has its accessed bits cleared
+// and is passed over once. Two sweeps always find a victim. The
+// accessed bits are found through the frame's reverse map.
+// Caller must hold kmem.lock.
+static struct core_map_entry *clock_victim(void) {
+  struct core_map_entry *r;
+  int i;
+
+  for (i = 0; i < 2 * npages; i++) {
+    r = &core_map[clock_hand];
+    clock_hand = (clock_hand + 1) % npages;
+    if (r->available || r->user != 1 || r->rmap == 0)
+      continue;
+    if (rmap_test_clear_accessed(r))
+      continue;
+    return r;
+  }
+  return 0;
 }
 
 // implemented for lab3 copy-on-write fork
 // increase ref_count of the page that PA is in
 void increment_pp_ref_ct(uint64_t pa) {
-  if (kmem.use_lock) {
-    acquire(&kmem.lock);
-  }
   struct core_map_entry* curr = pa2page(pa);
-  curr->ref_ct++;
-  if (kmem.use_lock) {
-    release(&kmem.lock);
+  __sync_fetch_and_add(&curr->ref_ct, 1);
+}
+
+// takes another reference to the mapped page that PA is in, unless a
+// swap-out has already claimed it by dropping its count to 0 (see
+// rmap_swap_out). returns 1 if it did, 0 if not
+int try_increment_pp_ref_ct(uint64_t pa) {
+  struct core_map_entry* curr = pa2page(pa);
+  int ct;
+
+  while ((ct = curr->ref_ct) > 0) {
+    if (__sync_bool_compare_and_swap(&curr->ref_ct, ct, ct + 1))
+      return 1;
   }
+  return 0;
 }
 
 // implemented for lab3 copy-on-write fork
-// copy on write: we are writing, so need to make a copy
-// decrease ref_count of the page that PA is in.
-// if ref_count is 1 before decrement -> we can just use the page, return 0
-// else return 1
+// copy on write: we are writing, so may need to make a copy
+// of the page that PA is in, which curr_page maps.
+// if we hold the only reference -> we can just use the page, return 0
+// else take another reference, so that the page stays put while it
+// is copied, and return 1; the caller drops it along with its own.
+// returns -1 if the page is being swapped out.
+// Caller must hold curr_page's lock.
 int cow_copy_out_page(uint64_t pa, struct vpage_info* curr_page) {
-  if (kmem.use_lock) {
-      acquire(&kmem.lock);
-  }
   struct core_map_entry* curr = pa2page(pa);
-  if (curr->ref_ct > 1) {
-    curr->ref_ct--;
-    if (kmem.use_lock) {
-    release(&kmem.lock);
+  int ct;
+
+  // compare-and-swap, so that we either see the count a racing
+  // swap-out drops to 0 or make it skip the page
+  while ((ct = curr->ref_ct) > 1) {
+    if (__sync_bool_compare_and_swap(&curr->ref_ct, ct, ct + 1))
+      return 1;
+  }
+  if (ct == 0)
+    return -1;
+  // 2.1. Set current vpage_info to writable and in not copy_on_write mode
+  curr_page->writable = 1;
+  curr_page->copy_on_write = 0;
+  return 0;
+}
+
+// Swap slots are handed out from a bitmap, one bit per slot, by a
+// next-fit search for a contiguous run so that pages evicted together
+// can be written with one disk request. A slot stays allocated until
+// nobody refers to it and it is no longer being written.
+// Protected by kmem.lock.
+static uint swap_map[SWAPSIZE_PAGES / 32];
+static int swap_rotor; // where the next search starts
+
+// Allocates n contiguous free swap slots and returns the first,
+// or -1 if there is no such run.
+static int swap_alloc(int n) {
+  int i, j, run, scanned;
+
+  run = 0;
+  i = swap_rotor;
+  for (scanned = 0; scanned < SWAPSIZE_PAGES + n; scanned++, i++) {
+    if (i == SWAPSIZE_PAGES) {
+      i = 0;
+      run = 0;
     }
-    return 1;
-  } else {
-    // 2.1. Set current vpage_info to writable and in not copy_on_write mode
-    curr_page->writable = 1;
-    curr_page->copy_on_write = 0;
-    // 2.2. Set page table permission to writable
-    if (kmem.use_lock) {
-    release(&kmem.lock);
+    if (i % 32 == 0 && swap_map[i / 32] == ~0U) {
+      // skip a full word at once
+      i += 31;
+      scanned += 31;
+      run = 0;
+      continue;
+    }
+    if (swap_map[i / 32] & (1U << (i % 32))) {
+      run = 0;
+      continue;
+    }
+    if (++run == n) {
+      for (j = i - n + 1; j <= i; j++)
+        swap_map[j / 32] |= 1U << (j % 32);
+      swap_rotor = (i + 1) % SWAPSIZE_PAGES;
+      pages_in_swap += n;
+      return i - n + 1;
     }
-    return 0;
   }
+  return -1;
 }
 
-static struct core_map_entry* get_rand_sat_page() {
-  struct core_map_entry* res = get_random_user_page();
-  while (res->user != 1 || PGNUM(page2pa(res)) == 0 || res->ref_ct == 0) {
-    res = get_random_user_page();
-  }
-  return res;
+static void swap_free(int index) {
+  swap_map[index / 32] &= ~(1U << (index % 32));
+  pages_in_swap--;
+  zswap_invalidate(index);
 }
 
-static int swap_out() {
-  int i;
-  struct core_map_entry* evicted_page;
+// Swaps out up to n pages chosen by the clock to a run of contiguous
+// slots. Pages that zswap keeps compressed in memory are done at once;
+// the rest are written with as few disk requests as possible, with
+// kmem.lock dropped meanwhile. Returns the number of pages freed.
+static int swap_out(int n) {
+  struct core_map_entry* victims[SWAP_CLUSTER];
+  char* va[SWAP_CLUSTER];
+  int i, j, slot, nr, cnt, tries;
+
   if (kmem.use_lock && !holding(&kmem.lock)) {
     panic("must be locked");
   }
-  // 1. find a free set of 8 blocks
-  for (i = 0; i < SWAPSIZE_PAGES; i++) {
-    if (swap_status[i].used == 0) {
-      // we have found the free region
-      // mark it as used
-      swap_status[i].used = 1;
-      pages_in_swap++;
-      break;
-    }
-  }
-  if (i == SWAPSIZE_PAGES) {
-    // if swap section is full
-    panic("SWAP REGION FULL");
-    return 0;
+  // 1. find a run of free slots, settling for fewer pages if needed
+  n = min(n, SWAP_CLUSTER);
+  while ((slot = swap_alloc(n)) < 0) {
+    if (n == 1)
+      return 0;
+    n /= 2;
   }
 
-  // 2. get a random user page to evict
-  evicted_page = get_rand_sat_page();
-
-  // 3. update all vspace_info if this page is involved
-  while (update_vspace(evicted_page, evicted_page->va, i, 0, PGNUM(page2pa(evicted_page)))) {
-    evicted_page = get_rand_sat_page();
+  // 2. let the clock pick pages that have not been used recently
+  // 3. and move everyone who maps each one over to its swap slot
+  for (nr = 0; nr < n; nr++) {
+    for (tries = 0;; tries++) {
+      if (tries == npages || (victims[nr] = clock_victim()) == 0)
+        goto chosen;
+      if ((cnt = rmap_swap_out(victims[nr], slot + nr)) >= 0)
+        break;
+    }
+    update_swap_ref_ct(cnt, slot + nr);
+    va[nr] = P2V(page2pa(victims[nr]));
+    // 4. try to keep it compressed in memory
+    if (!zswap_store(slot + nr, va[nr]))
+      swap_status[slot + nr].writeback = 1;
   }
+chosen:
+  for (i = nr; i < n; i++)
+    swap_free(slot + i);
+  if (nr == 0)
+    return 0;
 
   if (kmem.use_lock)
       release(&kmem.lock);
 
-  // 4. copy out data from the page and write to disk
-  swap_write(P2V(page2pa(evicted_page)), i);
-  
+  // 5. write the others out, one request per run of them
+  for (i = 0; i < nr; i = j) {
+    for (j = i; j < nr && swap_status[slot + j].writeback; j++)
+      ;
+    if (j > i)
+      swap_write(va + i, j - i, slot + i);
+    else
+      j++;
+  }
+
   if (kmem.use_lock)
     acquire(&kmem.lock);
 
-  // 6. mark the page as unused
-  evicted_page->available = 1;
-  evicted_page->user = 0;
-  evicted_page->va = 0;
+  for (i = 0; i < nr; i++) {
+    // 6. let faults on the slot read it back, or free it if every
+    // mapper exited in the meantime
+    if (swap_status[slot + i].writeback) {
+      swap_status[slot + i].writeback = 0;
+      if (swap_status[slot + i].ref_ct == 0)
+        swap_free(slot + i);
+      wakeup(&swap_status[slot + i]);
+    }
 
-  return 1;
+    // 7. hand the frame back to the allocator
+    if (victims[i]->ra) {
+      victims[i]->ra = 0;
+      __sync_fetch_and_add(&ra_misses, 1);
+    }
+    __sync_fetch_and_sub(&pages_in_use, 1);
+    __sync_fetch_and_add(&free_pages, 1);
+    buddy_free(victims[i], 0);
+  }
+
+  return nr;
 }
 
-int swap_in(uint on_disk_idx, uint addr) {
-  char* va = kalloc();
-  if (kmem.use_lock)
-    acquire(&kmem.lock);
-  if (va == 0){
-    if (kmem.use_lock) release(&kmem.lock);
+// Brings the pages in swap slots [slot, slot + n) back into memory
+// for every process that shares them, with one disk request. The
+// first slot is the one faulted on; the rest are readahead and are
+// marked so that their first touch counts as a hit. Data is read
+// before any page becomes visible, and slots stay pinned while read.
+// Returns the number of pages read, or -1 if no frame could be
+// allocated.
+int swap_in(uint slot, int n) {
+  struct core_map_entry* frame;
+  char* va[SWAP_CLUSTER];
+  char pinned[SWAP_CLUSTER];
+  int i, nr, cnt;
+
+  n = min(n, SWAP_CLUSTER);
+  for (nr = 0; nr < n; nr++) {
+    if ((va[nr] = kalloc()) == 0)
+      break;
+  }
+  if (nr == 0) {
     cprintf("fail in kalloc\n");
     return -1;
   }
-  struct core_map_entry* swapped_in_page = pa2page(V2P(va));
-  swapped_in_page->ref_ct = 0;
-  mark_user_mem(V2P(va), (uint64_t) va);
 
-  update_vspace(swapped_in_page, addr, on_disk_idx, 1, PGNUM(page2pa(swapped_in_page)));
-  if (kmem.use_lock)
-    release(&kmem.lock);
-  swap_read(va, on_disk_idx);
-  swap_status[on_disk_idx].used = 0;
+  acquire(&kmem.lock);
+  while (swap_status[slot].writeback)
+    sleep(&swap_status[slot], &kmem.lock);
+  // don't wait for readahead; stop at the first slot still being written
+  for (i = 1; i < nr; i++) {
+    if (swap_status[slot + i].writeback)
+      break;
+  }
+  for (; nr > i; nr--)
+    kfree(va[nr - 1]);
+  for (i = 0; i < nr; i++) {
+    // a slot without references was swapped in by someone else
+    // (or freed) while we were allocating
+    if ((pinned[i] = swap_status[slot + i].ref_ct > 0))
+      __sync_fetch_and_add(&swap_status[slot + i].ref_ct, 1);
+  }
+  release(&kmem.lock);
+
+  // pages zswap kept in memory need no disk I/O, but the others are
+  // read as one run and the in-memory ones written over them after
+  for (i = 0; i < nr; i++) {
+    if (pinned[i] && !zswap_has(slot + i)) {
+      swap_read(va, nr, slot);
+      break;
+    }
+  }
+  for (i = 0; i < nr; i++) {
+    if (pinned[i])
+      zswap_load(slot + i, va[i]);
+  }
+
+  acquire(&kmem.lock);
+  for (i = 0; i < nr; i++) {
+    cnt = 0;
+    if (pinned[i]) {
+      frame = pa2page(V2P(va[i]));
+      mark_user_mem(V2P(va[i]));
+      cnt = rmap_swap_in(slot + i, frame);
+      update_swap_ref_ct(-(cnt + 1), slot + i);
+      if (cnt > 0 && i > 0) {
+        frame->ra = 1;
+        __sync_fetch_and_add(&ra_pages, 1);
+      }
+    }
+    // every sharer exited while we read it
+    if (cnt == 0)
+      kfree(va[i]);
+  }
+  release(&kmem.lock);
+  return nr;
+}
+
+// Called on the first touch of a present page that has no PTE yet.
+// Returns 1, counting a readahead hit, if the page was read ahead.
+int swap_ra_hit(uint64_t pa) {
+  struct core_map_entry* frame = pa2page(pa);
+
+  if (!frame->ra)
+    return 0;
+  frame->ra = 0;
+  __sync_fetch_and_add(&ra_hits, 1);
   return 1;
 }
 
-// increase/decrease ref_ct of a swap region
-// direction = 1 to increase
-// direction = -1 to decrease
-void update_swap_ref_ct(int direction, int index) {
+// Reports readahead counters for sysinfo: pages read ahead, pages
+// touched after being read ahead, and pages freed or evicted untouched.
+void swap_ra_stats(int* pages, int* hits, int* misses) {
+  *pages = ra_pages;
+  *hits = ra_hits;
+  *misses = ra_misses;
+}
+
+// adds delta to the ref_ct of a swap region,
+// freeing the region when nobody refers to it anymore
+void update_swap_ref_ct(int delta, int index) {
   int lock = 0;
   if (kmem.use_lock) {
     if (!holding(&kmem.lock)) {
@@ -343,11 +846,18 @@ void update_swap_ref_ct(int direction, int index) {
       lock = 1;
     }
   }
-  swap_status[index].ref_ct = swap_status[index].ref_ct + direction * 1;
-  if (swap_status[index].ref_ct == 0) {
-    swap_status[index].used = 0;
-    pages_in_swap--;
-  }
+  // atomic, for increment_swap_ref_ct()
+  if (__sync_add_and_fetch(&swap_status[index].ref_ct, delta) == 0 &&
+      !swap_status[index].writeback)
+    swap_free(index);
   if (kmem.use_lock && lock)
     release(&kmem.lock);
-}
\ No newline at end of file
+}
+
+// takes another reference to a swap region for a page that is
+// swapped out to it, without kmem.lock so that it can be done with
+// the page locked. The count cannot drop to 0 meanwhile, since the
+// page still holds its own reference.
+void increment_swap_ref_ct(int index) {
+  __sync_fetch_and_add(&swap_status[index].ref_ct, 1);
+}
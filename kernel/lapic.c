@@ -129,6 +129,14 @@ void lapiceoi(void) {
 // On real hardware would want to tune this dynamically.
 void microdelay(int us) {}
 
+// Sends interrupt vector to the cpu whose local APIC is apicid.
+void lapicipi(uchar apicid, int vector) {
+  lapicw(ICRHI, apicid << 24);
+  lapicw(ICRLO, FIXED | vector);
+  while (lapic[ICRLO] & DELIVS)
+    ;
+}
+
 #define CMOS_PORT 0x70
 #define CMOS_RETURN 0x71
 
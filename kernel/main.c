@@ -3,15 +3,25 @@
 #include <defs.h>
 #include <e820.h>
 #include <memlayout.h>
+#include <proc.h>
 #include <trap.h>
+#include <x86_64.h>
+#include <x86_64vm.h>
 
+static void startothers(void);
 noreturn static void mpmain(void);
+noreturn void mpenter(void);
 extern char _end[]; // first address after kernel loaded from ELF file
 
 int main(uint64_t addr) {
+  seginit(); // segment table, and %gs for mycpu()
   e820_init(addr);
   detect_memory();
   mem_init(_end); // phys page allocator
+  rmapinit();     // reverse maps for user pages
+  zswapinit();    // compressed swap pool
+  pcacheinit();   // shared program pages
+  shminit();      // shared memory objects
   vspacebootinit();
   mpinit();
   lapicinit();
@@ -28,14 +38,54 @@ int main(uint64_t addr) {
   binit();    // buffer cache
   ideinit();  // disk
   userinit(); // first user process
+  kthreadcreate("kswapd", kswapd); // background page-out
+  startothers(); // start other processors
   mpmain();
   return 0;
 }
 
+// Other CPUs jump here from entry.S, on the kernel's page table.
+void mpenter(void) {
+  seginit();
+  lapicinit();
+  mpmain();
+}
+
 // Common CPU setup code.
 static void mpmain(void) {
   cprintf("cpu%d: starting\n", cpunum());
   idtinit(); // load idt register
-  // xchg(&cpu->started, 1); // tell startothers() we're up
+  xchg(&mycpu()->started, 1); // tell startothers() we're up
   scheduler(); // start running processes
 }
+
+extern char ap_start[], ap_end[]; // AP trampoline in entry.S
+
+// Start the non-boot (AP) processors.
+static void startothers(void) {
+  struct cpu *c;
+  char *code, *stack;
+
+  // Write the trampoline to unused memory at AP_ENTRY.
+  code = P2V(AP_ENTRY);
+  memmove(code, ap_start, ap_end - ap_start);
+
+  for (c = cpus; c < &cpus[ncpu]; c++) {
+    if (c == mycpu()) // We've started already.
+      continue;
+
+    // Tell the trampoline which cpu it is starting, and where that
+    // cpu's scheduler stack is. Memory past _end belongs to the page
+    // allocator, so STACK_TOP() cannot be used for it.
+    if ((stack = kalloc_pages(1)) == 0 || V2P(stack) >= 0x100000000)
+      panic("startothers: no stack");
+    *(uint *)(code - AP_OFFSET_STACK) = V2P(stack + STACK_SIZE);
+    *(uint *)(code - AP_OFFSET_CPUNUM) = c - cpus;
+
+    lapicstartap(c->apicid, AP_ENTRY);
+
+    // wait for cpu to finish mpmain()
+    while (c->started == 0)
+      ;
+  }
+}
@@ -34,6 +34,7 @@ void ideintr(void) {
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
 void iderw(struct buf *b) {
   uchar *p;
+  int i;
 
   if (!holdingsleep(&b->lock))
     panic("iderw: buf not locked");
@@ -46,7 +47,17 @@ void iderw(struct buf *b) {
 
   p = memdisk + b->blockno * BSIZE;
 
-  if (b->flags & B_DIRTY) {
+  if (b->pages) {
+    if (b->blockno + b->npages * (PGSIZE / BSIZE) > disksize)
+      panic("iderw: block out of range");
+    for (i = 0; i < b->npages; i++, p += PGSIZE) {
+      if (b->flags & B_DIRTY)
+        memmove(p, b->pages[i], PGSIZE);
+      else
+        memmove(b->pages[i], p, PGSIZE);
+    }
+    b->flags &= ~B_DIRTY;
+  } else if (b->flags & B_DIRTY) {
     b->flags &= ~B_DIRTY;
     memmove(p, b->data, BSIZE);
   } else
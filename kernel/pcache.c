@@ -0,0 +1,135 @@
+// Cache of pages read in from executables.
+//
+// vspacefillpage() reads a program's pages in from its executable on
+// first touch. Every page it reads is offered to this cache, keyed by
+// the file's (dev, inum) and the page's address in the program, and
+// the next process to fault on the same page of the same binary maps
+// the cached frame instead of reading its own copy. Programs are
+// linked into one writable segment, so a shared frame is mapped
+// copy-on-write and a process that writes to it gets a private copy.
+//
+// The cache holds a reference to each frame it keeps. Cached frames
+// therefore have more references than mappings and are never swapped
+// out, which is why the cache is kept small (PCACHE_PAGES) and gives
+// up old entries in clock order. Writing to a file or deleting it
+// drops its pages.
+//
+// pcache.lock protects the table. Nothing is allocated or freed
+// while it is held.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <spinlock.h>
+
+struct {
+  struct spinlock lock;
+  struct {
+    uint dev;
+    uint inum;
+    uint64_t va;  // page's address in the program
+    char *page;   // kernel address of the frame, 0 if the entry is free
+    int accessed; // used since the clock hand last passed
+  } ent[PCACHE_PAGES];
+  int hand;   // clock hand for eviction
+  int pages;  // entries in use
+  int hits;   // faults served from the cache
+  int misses; // faults that read the page from disk
+} pcache;
+
+void pcacheinit(void) { initlock(&pcache.lock, "pcache"); }
+
+// Looks up page va of file (dev, inum). Returns the frame's kernel
+// address with a new reference for the caller, or 0.
+char *pcache_get(uint dev, uint inum, uint64_t va) {
+  char *page = 0;
+  int i;
+
+  acquire(&pcache.lock);
+  for (i = 0; i < PCACHE_PAGES; i++) {
+    if (pcache.ent[i].page && pcache.ent[i].dev == dev &&
+        pcache.ent[i].inum == inum && pcache.ent[i].va == va) {
+      page = pcache.ent[i].page;
+      pcache.ent[i].accessed = 1;
+      increment_pp_ref_ct(V2P(page));
+      break;
+    }
+  }
+  if (page)
+    pcache.hits++;
+  else
+    pcache.misses++;
+  release(&pcache.lock);
+  return page;
+}
+
+// Offers page, just read in as page va of file (dev, inum), to the
+// cache, which takes its own reference. Returns 1 if the page is now
+// cached and so may be shared, or 0 if another copy got there first.
+int pcache_put(uint dev, uint inum, uint64_t va, char *page) {
+  char *old = 0;
+  int i, slot = -1;
+
+  acquire(&pcache.lock);
+  for (i = 0; i < PCACHE_PAGES; i++) {
+    if (!pcache.ent[i].page) {
+      if (slot < 0)
+        slot = i;
+    } else if (pcache.ent[i].dev == dev && pcache.ent[i].inum == inum &&
+               pcache.ent[i].va == va) {
+      release(&pcache.lock);
+      return 0;
+    }
+  }
+  // full: evict the first entry the clock finds unused
+  while (slot < 0) {
+    i = pcache.hand;
+    pcache.hand = (pcache.hand + 1) % PCACHE_PAGES;
+    if (pcache.ent[i].accessed)
+      pcache.ent[i].accessed = 0;
+    else
+      slot = i;
+  }
+  if ((old = pcache.ent[slot].page) == 0)
+    pcache.pages++;
+  increment_pp_ref_ct(V2P(page));
+  pcache.ent[slot].dev = dev;
+  pcache.ent[slot].inum = inum;
+  pcache.ent[slot].va = va;
+  pcache.ent[slot].page = page;
+  pcache.ent[slot].accessed = 1;
+  release(&pcache.lock);
+
+  if (old)
+    kfree(old);
+  return 1;
+}
+
+// Drops every cached page of file (dev, inum) once its contents change.
+void pcache_invalidate(uint dev, uint inum) {
+  char *drop[PCACHE_PAGES];
+  int i, n = 0;
+
+  acquire(&pcache.lock);
+  for (i = 0; i < PCACHE_PAGES; i++) {
+    if (pcache.ent[i].page && pcache.ent[i].dev == dev &&
+        pcache.ent[i].inum == inum) {
+      drop[n++] = pcache.ent[i].page;
+      pcache.ent[i].page = 0;
+      pcache.pages--;
+    }
+  }
+  release(&pcache.lock);
+
+  for (i = 0; i < n; i++)
+    kfree(drop[i]);
+}
+
+// Reports pages cached, hits and misses, for sysinfo.
+void pcache_stats(int *pages, int *hits, int *misses) {
+  *pages = pcache.pages;
+  *hits = pcache.hits;
+  *misses = pcache.misses;
+}
@@ -7,6 +7,7 @@
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <spawn.h>
 #include <spinlock.h>
 #include <trap.h>
 #include <x86_64.h>
@@ -15,19 +16,60 @@
 #include <vspace.h>
 
 // process table
+//
+// ptable.lock protects the lifecycle of processes: taking and freeing
+// slots (changes to and from UNUSED and ZOMBIE) and parent links.
+// Each p->lock protects p's state while it lives, but for waking it
+// from sleep (see chanq), and is held across the switch into and
+// out of p. It is taken after ptable.lock.
 struct
 {
   struct spinlock lock;
   struct proc proc[NPROC];
 } ptable;
 
+// Run queues, one per cpu, of RUNNABLE processes. A process is
+// queued on the cpu it last ran on; a cpu whose queue is empty
+// steals from the longest other queue. A run queue's lock is taken
+// after p->lock.
+//
+// Each queue is a multi-level feedback queue: NPRIO FIFO levels, run
+// highest (0) first. A process that uses up its level's time slice,
+// 1 << level ticks, drops a level; one that sleeps keeps its level,
+// so interactive processes stay ahead of CPU hogs. Every BOOSTTICKS
+// all processes go back to the top level their nice value allows,
+// so that hogs are not starved for good.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n; // processes queued, at all levels
+} runq[NCPU];
+
+// Wait channels. A sleeping process is linked by p->chnext on the
+// queue its channel hashes to, so wakeup() looks only at processes
+// that sleep on channels in that queue rather than at every process.
+// A queue's lock protects the queue, and the chan and SLEEPING state
+// of the processes on it. It is taken after p->lock and before a run
+// queue's lock.
+#define CHANQ_SHIFT 6
+#define NCHANQ (1 << CHANQ_SHIFT)
+
+struct chanq {
+  struct spinlock lock;
+  struct proc *head;
+} chanq[NCHANQ];
+
+// Count of boosts. Queued processes are boosted in place; the others
+// catch up (see boosted) when they are next queued or charged a tick.
+static uint boostgen;
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
 
 // to test crash safety in lab5,
 // we trigger restarts in the middle of file operations
@@ -42,7 +84,177 @@ loop:
   goto loop;
 }
 
-void pinit(void) { initlock(&ptable.lock, "ptable"); }
+void pinit(void)
+{
+  struct proc *p;
+  int i;
+
+  initlock(&ptable.lock, "ptable");
+  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    initlock(&p->lock, "proc");
+  for (i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for (i = 0; i < NCHANQ; i++)
+    initlock(&chanq[i].lock, "chanq");
+}
+
+// Returns the wait queue for chan. Channels are addresses of objects
+// whose sizes are often powers of two, so the hash multiplies rather
+// than taking low bits.
+static struct chanq *chanqof(void *chan)
+{
+  return &chanq[((uint64_t)chan * 0x9E3779B97F4A7C15ULL) >> (64 - CHANQ_SHIFT)];
+}
+
+// Moves p to the top level its nice value allows if there has been
+// a boost since it was last queued or charged a tick.
+static void boosted(struct proc *p)
+{
+  if (p->boostgen != boostgen) {
+    p->boostgen = boostgen;
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+}
+
+// adds p at the tail of its level in rq; caller must hold rq->lock
+static void rqput(struct runq *rq, struct proc *p)
+{
+  p->rqnext = 0;
+  if (rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->n++;
+}
+
+// Marks p runnable and queues it on the cpu it last ran on.
+// Caller must hold p->lock, or if p sleeps, its wait queue's lock.
+static void setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  boosted(p);
+  rqput(rq, p);
+  release(&rq->lock);
+}
+
+// Takes the first process off the highest nonempty level of run
+// queue rq, or returns 0.
+static struct proc *runqget(struct runq *rq)
+{
+  struct proc *p = 0;
+  int i;
+
+  acquire(&rq->lock);
+  for (i = 0; i < NPRIO; i++) {
+    if ((p = rq->head[i]) != 0) {
+      if ((rq->head[i] = p->rqnext) == 0)
+        rq->tail[i] = 0;
+      rq->n--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Takes a process from the longest run queue other than cpu's own,
+// or returns 0 if they are all empty. The lengths are read without
+// locks, so this is only a guess at the busiest cpu.
+static struct proc *runqsteal(int cpu)
+{
+  struct runq *rq, *busiest = 0;
+
+  for (rq = runq; rq < &runq[ncpu]; rq++)
+    if (rq != &runq[cpu] && rq->n > 0 && (!busiest || rq->n > busiest->n))
+      busiest = rq;
+  return busiest ? runqget(busiest) : 0;
+}
+
+// Charges the current process for a timer tick. It drops a level
+// once it has used up its level's time slice. Returns 1 if it should
+// yield: when its slice is up, or when a process of higher priority
+// is waiting on this cpu.
+int schedtick(void)
+{
+  struct proc *p = myproc();
+  int i;
+
+  boosted(p);
+  if (++p->slice >= (1 << p->prio)) {
+    p->slice = 0;
+    if (p->prio < NPRIO - 1)
+      p->prio++;
+    return 1;
+  }
+  // a racy look, but the next tick looks again
+  for (i = 0; i < p->prio; i++)
+    if (runq[p->cpu].head[i])
+      return 1;
+  return 0;
+}
+
+// Moves every queued process back to the top level its nice value
+// allows, and has the others follow when they are next queued or
+// run. Called every BOOSTTICKS.
+void schedboost(void)
+{
+  struct proc *p, *list[NPRIO];
+  struct runq *rq;
+  int i;
+
+  boostgen++;
+  for (rq = runq; rq < &runq[ncpu]; rq++) {
+    acquire(&rq->lock);
+    for (i = 0; i < NPRIO; i++) {
+      list[i] = rq->head[i];
+      rq->head[i] = rq->tail[i] = 0;
+    }
+    rq->n = 0;
+    // keeps the order of levels, and of processes within them
+    for (i = 0; i < NPRIO; i++) {
+      while ((p = list[i]) != 0) {
+        list[i] = p->rqnext;
+        boosted(p);
+        rqput(rq, p);
+      }
+    }
+    release(&rq->lock);
+  }
+}
+
+// Adds inc to the current process's nice value, clamped to
+// [0, NPRIO-1], and returns the new value. A process never runs at
+// a level above its nice value; children inherit it.
+int nice(int inc)
+{
+  struct proc *p = myproc();
+  int n;
+
+  acquire(&p->lock);
+  n = p->nice + inc;
+  if (n < 0)
+    n = 0;
+  if (n > NPRIO - 1)
+    n = NPRIO - 1;
+  p->nice = n;
+  if (p->prio < n)
+    p->prio = n;
+  release(&p->lock);
+  return n;
+}
+
+// Lets p, just set up by its creator, run.
+static void start(struct proc *p)
+{
+  acquire(&p->lock);
+  setrunnable(p);
+  release(&p->lock);
+}
 
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
@@ -66,6 +278,12 @@ found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->killed = 0;
+  p->vforked = 0;
+  p->cpu = mycpu() - cpus; // where its creator runs; others may steal it
+  p->nice = myproc() ? myproc()->nice : 0;
+  p->prio = p->nice;
+  p->slice = 0;
+  p->boostgen = boostgen;
 
   release(&ptable.lock);
 
@@ -115,13 +333,22 @@ void userinit(void)
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
 
-  // this assignment to p->state lets other cores
-  // run this process. the acquire forces the above
-  // writes to be visible, and the lock is also needed
-  // because the assignment might not be atomic.
-  acquire(&ptable.lock);
-  p->state = RUNNABLE;
-  release(&ptable.lock);
+  // queueing p lets other cores run this process. the
+  // acquire forces the above writes to be visible.
+  start(p);
+}
+
+// gives child its own references to every file p has open
+static void forkfiles(struct proc *child, struct proc *p)
+{
+  for (int fd = 0; fd < NOFILE; fd++)
+  {
+    if (p->fds[fd] != NULL)
+    {
+      child->fds[fd] = p->fds[fd];
+      file_incref(p->fds[fd]);
+    }
+  }
 }
 
 // Create a new process copying p as the parent.
@@ -130,24 +357,24 @@ void userinit(void)
 int fork(void)
 {
   // 1. create a new entry in the process table
+  // the child stays EMBRYO, invisible to the scheduler, until step 5,
+  // so ptable.lock is not held while its memory is copied (which may
+  // sleep on swap I/O)
   struct proc *p = myproc();
   struct proc *child = allocproc();
-  acquire(&ptable.lock);
   if (child == 0) {
-    release(&ptable.lock);
     return -1;
   }
   child->parent = p;
 
   // 2. duplicate user memory
   if (vspaceinit(&child->vspace) != 0) {
-    release(&ptable.lock);
-    return -1;
+    goto fork_failure;
   }
   // 2.1 copy-on-write
   if (vspacecopy(&child->vspace, &p->vspace) != 0) {
-    release(&ptable.lock);
-    return -1;
+    vspacefree(&child->vspace);
+    goto fork_failure;
   }
   // if (vspacemapregions(&child->vspace, &p->vspace) != 0) {
   //   release(&ptable.lock);
@@ -159,31 +386,170 @@ int fork(void)
   memmove(child->tf, p->tf, sizeof(*p->tf));
 
   // 4. duplicate all the open files
-  for (int fd = 0; fd < NOFILE; fd++)
-  {
-    struct finfo* curr_file = p->fds[fd];
-    if (curr_file != NULL)
-    {
-      child->fds[fd] = &(*curr_file); // off by one bug
-      curr_file->ref_ct += 1;
-      if (curr_file->type == PIPE) {
-        struct pipe* curr_pipe = (struct pipe*) (curr_file->ip);
-        acquire(&curr_pipe->lock);
-        if (curr_file->access_permi == O_RDONLY) {
-          curr_pipe->read_ref_ct++;
-        } else {
-          curr_pipe->write_ref_ct++;
-        }
-        release(&curr_pipe->lock);
-      }
-    }
-  }
+  forkfiles(child, p);
 
   // 5. change child's state
-  child->state = RUNNABLE;
   child->tf->rax = 0; // return for child process
+  start(child);
+  return child->pid;
+
+fork_failure:
+  kfree(child->kstack);
+  acquire(&ptable.lock);
+  child->state = UNUSED;
   release(&ptable.lock);
+  return -1;
+}
+
+// Like fork, but the child borrows the parent's address space
+// instead of getting a copy, and the parent sleeps until the child
+// hands it back by calling exec or exit. Nothing is copied, so this
+// is what a shell wants before exec. Until then the two share all of
+// memory, stack included, and the child should do little else.
+int vfork(void)
+{
+  struct proc *p = myproc();
+  struct proc *child = allocproc();
+  int pid;
+
+  if (child == 0) {
+    return -1;
+  }
+  child->parent = p;
+  child->vforked = 1;
+  // p keeps its copy of the descriptor, naming the same page table
+  // and page descriptors, only so that it can still be installed if
+  // it is woken before the child is done
+  child->vspace = p->vspace;
+  memmove(child->tf, p->tf, sizeof(*p->tf));
+  forkfiles(child, p);
+  child->tf->rax = 0; // return for child process
+  pid = child->pid;
+
+  acquire(&ptable.lock);
+  start(child);
+  // if p is killed, it exits, leaving the address space to the child
+  while (child->vforked && !p->killed)
+    sleep(child, &ptable.lock);
+  release(&ptable.lock);
+  return pid;
+}
+
+// Gives the address space vs, which the current process borrowed
+// from its parent in vfork, back to the parent and wakes it up.
+// Returns -1, leaving vs to the caller, if the parent has exited.
+int vforkdone(struct vspace *vs)
+{
+  struct proc *p = myproc();
+  int lock = !holding(&ptable.lock);
+  int ret = -1;
+
+  if (lock)
+    acquire(&ptable.lock);
+  if (p->vforked) {
+    vspacemove(&p->parent->vspace, vs);
+    p->vforked = 0;
+    wakeup(p);
+    ret = 0;
+  }
+  if (lock)
+    release(&ptable.lock);
+  return ret;
+}
+
+// Starts the program at path with the arguments argv, both in the
+// current process's memory, in a new child, with the effect of fork
+// followed by exec. But the parent's address space is not copied:
+// the child's is built straight from the program. The child starts
+// with the parent's open files, changed by the file actions in acts.
+// Returns the child's pid, or -1.
+int spawn(char *path, char **argv, struct spawn_action *acts)
+{
+  struct proc *p = myproc();
+  struct proc *child = allocproc();
+  struct spawn_action *a;
+  struct finfo *f;
+
+  if (child == 0) {
+    return -1;
+  }
+  child->parent = p;
+
+  // 1. build the new program's address space
+  memset(child->tf, 0, sizeof(*child->tf));
+  child->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+  child->tf->ss = (SEG_UDATA << 3) | DPL_USER;
+  child->tf->rflags = FLAGS_IF;
+  if (vspaceinit(&child->vspace) != 0 ||
+      execload(&child->vspace, path, argv, child->tf) != 0) {
+    vspacefree(&child->vspace);
+    goto spawn_failure;
+  }
+
+  // 2. inherit the open files, then apply the file actions
+  forkfiles(child, p);
+  for (a = acts; a->op != SPAWN_END; a++) {
+    if (a->fd < 0 || a->fd >= NOFILE || (f = child->fds[a->fd]) == NULL)
+      goto files_failure;
+    if (a->op == SPAWN_DUP) {
+      if (a->newfd < 0 || a->newfd >= NOFILE)
+        goto files_failure;
+      if (a->newfd == a->fd)
+        continue;
+      file_incref(f);
+      if (child->fds[a->newfd] != NULL)
+        file_decref(child->fds[a->newfd]);
+      child->fds[a->newfd] = f;
+    } else if (a->op == SPAWN_CLOSE) {
+      child->fds[a->fd] = NULL;
+      file_decref(f);
+    } else {
+      goto files_failure;
+    }
+  }
+
+  // 3. let it run
+  start(child);
   return child->pid;
+
+files_failure:
+  for (int fd = 0; fd < NOFILE; fd++) {
+    if (child->fds[fd] != NULL) {
+      file_decref(child->fds[fd]);
+      child->fds[fd] = NULL;
+    }
+  }
+  vspacefree(&child->vspace);
+spawn_failure:
+  kfree(child->kstack);
+  acquire(&ptable.lock);
+  child->state = UNUSED;
+  release(&ptable.lock);
+  return -1;
+}
+
+// Creates a kernel thread that runs fn, which must never return.
+// The thread has an empty user address space and no parent.
+struct proc *kthreadcreate(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if ((p = allocproc()) == 0)
+    return 0;
+  if (vspaceinit(&p->vspace) != 0) {
+    kfree(p->kstack);
+    acquire(&ptable.lock);
+    p->state = UNUSED;
+    release(&ptable.lock);
+    return 0;
+  }
+  p->parent = 0;
+  // forkret "returns" into fn instead of trapret
+  *(uint64_t *)(p->context + 1) = (uint64_t)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  start(p);
+  return p;
 }
 
 // Exit the current process.  Does not return.
@@ -194,10 +560,16 @@ void exit(void)
   struct proc* p = myproc();
   acquire(&ptable.lock);
 
-  // 1. set all its running children's parent to root
+  // 1. set all its running children's parent to root; a vfork child
+  // still running in our address space keeps it
   for (struct proc* curr = ptable.proc; curr < &ptable.proc[NPROC]; curr++) {
-    if (curr->parent->pid == p->pid && curr->state != UNUSED) {
+    if (curr->parent == p && curr->state != UNUSED) {
       curr->parent = initproc;
+      if (curr->vforked) {
+        vspaceinstallkern();
+        memset(&p->vspace, 0, sizeof(p->vspace));
+        curr->vforked = 0;
+      }
     }
   }
 
@@ -210,15 +582,22 @@ void exit(void)
     }
   }
 
-  // 3. set its state to ZOMBIE
+  // 3. give a borrowed address space back to the vfork parent
+  if (p->vforked)
+    vforkdone(&p->vspace);
+
+  // 4. wake its parent up; it cannot look before we are a zombie
+  wakeup(p->parent);
+
+  // 5. set its state to ZOMBIE, keeping p->lock until the switch
+  // away is over (see wait)
+  acquire(&p->lock);
   p->state = ZOMBIE;
   p->killed = 0;
   p->chan = 0;
-
-  // 5. wake its parent up
-  wakeup1(p->parent);
-  sched();
   release(&ptable.lock);
+  sched();
+  panic("zombie exit");
 }
 
 // Wait for a child process to exit and return its pid.
@@ -233,7 +612,7 @@ int wait(void)
     acquire(&ptable.lock);
     child_count = 0;
     for (struct proc* curr = ptable.proc; curr < &ptable.proc[NPROC]; curr++) {
-      if (curr->parent->pid == p->pid && curr->state != UNUSED) {
+      if (curr->parent == p && curr->state != UNUSED) {
         child_count++;
         if (curr->state == ZOMBIE) {
           zombie = curr;
@@ -252,6 +631,10 @@ int wait(void)
     release(&ptable.lock);
   }
 
+  // exit() holds the zombie's lock until it is off its stack
+  acquire(&zombie->lock);
+  release(&zombie->lock);
+
   // cleanup the child proc
   kfree(zombie->kstack);
   vspacefree(&(zombie->vspace));
@@ -265,44 +648,44 @@ int wait(void)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run
+//  - take a process off this cpu's run queue, or steal one
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
 void scheduler(void)
 {
   struct proc *p;
+  struct cpu *c = mycpu();
+  int cpu = c - cpus;
 
   for (;;)
   {
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    {
-      if (p->state != RUNNABLE)
-        continue;
+    if ((p = runqget(&runq[cpu])) == 0 && (p = runqsteal(cpu)) == 0)
+      continue;
 
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      mycpu()->proc = p;
-      vspaceinstall(p);
-      p->state = RUNNING;
-      swtch(&mycpu()->scheduler, p->context);
-      vspaceinstallkern();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      mycpu()->proc = 0;
-    }
-    release(&ptable.lock);
+    // Switch to chosen process.  It is the process's job
+    // to release p->lock and then reacquire it
+    // before jumping back to us. If p is still switching
+    // away on another cpu, the acquire waits for that.
+    acquire(&p->lock);
+    p->cpu = cpu;
+    c->proc = p;
+    vspaceinstall(p);
+    p->state = RUNNING;
+    swtch(&c->scheduler, p->context);
+    vspaceinstallkern();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -313,8 +696,8 @@ void sched(void)
 {
   int intena;
 
-  if (!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if (!holding(&myproc()->lock))
+    panic("sched p->lock");
   if (mycpu()->ncli != 1) {
     cprintf("pid : %d\n", myproc()->pid);
     cprintf("ncli : %d\n", mycpu()->ncli);
@@ -335,10 +718,12 @@ void sched(void)
 // Give up the CPU for one scheduling round.
 void yield(void)
 {
-  acquire(&ptable.lock); // DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+
+  acquire(&p->lock); // DOC: yieldlock
+  setrunnable(p);
   sched();
-  release(&ptable.lock);
+  release(&p->lock);
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -346,8 +731,8 @@ void yield(void)
 void forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
 
   if (first)
   {
@@ -365,57 +750,79 @@ void forkret(void)
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk)
 {
-  if (myproc() == 0)
+  struct proc *p = myproc();
+  struct chanq *q = chanqof(chan);
+
+  if (p == 0)
     panic("sleep");
 
   if (lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
+  // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
+  // Once we are on chan's wait queue, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
+  // (wakeup looks at that queue under its lock),
   // so it's okay to release lk.
-  if (lk != &ptable.lock)
-  {                        // DOC: sleeplock0
-    acquire(&ptable.lock); // DOC: sleeplock1
-    release(lk);
-  }
-
-  // Go to sleep.
-  myproc()->chan = chan;
-  myproc()->state = SLEEPING;
+  acquire(&p->lock); // DOC: sleeplock1
+  acquire(&q->lock);
+  p->chan = chan;
+  p->state = SLEEPING;
+  p->chnext = q->head;
+  q->head = p;
+  release(&q->lock);
+  release(lk);
+
+  // Go to sleep. Whoever wakes us clears p->chan.
   sched();
 
-  // Tidy up.
-  myproc()->chan = 0;
-
   // Reacquire original lock.
-  if (lk != &ptable.lock)
-  { // DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  release(&p->lock);
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
-// The ptable lock must be held.
-static void wakeup1(void *chan)
+// Caller should hold the lock that sleepers on chan pass to sleep.
+void wakeup(void *chan)
 {
-  struct proc *p;
+  struct chanq *q = chanqof(chan);
+  struct proc **pp, *p;
 
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if (p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  acquire(&q->lock);
+  for (pp = &q->head; (p = *pp) != 0;)
+  {
+    if (p->chan == chan) {
+      *pp = p->chnext;
+      p->chan = 0;
+      setrunnable(p);
+    } else {
+      pp = &p->chnext;
+    }
+  }
+  release(&q->lock);
 }
 
-// Wake up all processes sleeping on chan.
-void wakeup(void *chan)
+// Wakes p if it is asleep. Caller must hold p->lock, so that p
+// cannot go to sleep on another channel meanwhile.
+static void unsleep(struct proc *p)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  void *chan = p->chan;
+  struct chanq *q;
+  struct proc **pp;
+
+  if (chan == 0) // not asleep, or being woken already
+    return;
+  q = chanqof(chan);
+  acquire(&q->lock);
+  if (p->state == SLEEPING && p->chan == chan) {
+    for (pp = &q->head; *pp != p; pp = &(*pp)->chnext)
+      ;
+    *pp = p->chnext;
+    p->chan = 0;
+    setrunnable(p);
+  }
+  release(&q->lock);
 }
 
 // Kill the process with the given pid.
@@ -430,10 +837,11 @@ int kill(int pid)
   {
     if (p->pid == pid)
     {
+      acquire(&p->lock);
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if (p->state == SLEEPING)
-        p->state = RUNNABLE;
+      unsleep(p);
+      release(&p->lock);
       release(&ptable.lock);
       return 0;
     }
@@ -487,67 +895,10 @@ struct proc *findproc(int pid)
 int sbrk(int n) {
   struct vregion* heap = &(myproc()->vspace.regions[VR_HEAP]);
   uint64_t prev_brk = heap->size + heap->va_base;
-  // vregionaddmap handles everything including rounding to see if calling kalloc is needed
-  int size = vregionaddmap(heap, prev_brk, n, VPI_PRESENT, VPI_WRITABLE);
+  // the new pages are demand-zero; memory is only allocated when they are written
+  int size = vregionaddzero(heap, prev_brk, n);
   if (size < 0) return -1;
   heap->size += size;
-  vspaceinvalidate(&(myproc()->vspace));
+  // nothing to map: demand-zero pages fault in on first touch
   return prev_brk;
 }
-
-// evicting_page: core_map_entry of the envciting/loading page
-// swap_array_index: index of the swap array where the data of the page is going to store/ is storing on disk
-// in: 1 -> load back, 0 -> swap out
-int update_vspace(struct core_map_entry* evicting_page, uint va, int swap_array_index, int in, uint ppn) {
-  struct proc* p;
-  char lk = 0;
-  // loop through all processes
-  if (!holding(&ptable.lock)) {
-    acquire(&ptable.lock);
-    lk = 1;
-  }
-  for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    if (p->state == UNUSED)
-      continue;
-    // check if the process' vspace will be affected
-    struct vregion* curr_region = va2vregion(&p->vspace, va);
-    if (curr_region == 0) {
-      curr_region = va2vregion(&p->vspace, va - 1);
-      if (curr_region == 0) {
-        continue;  // such va does not exist in this proc
-      }
-    }
-    struct vpage_info* curr_info = va2vpage_info(curr_region, va);
-    if (in) {
-      if (curr_info->present != 0 || curr_info->on_disk != swap_array_index) {
-        continue;
-      }
-      curr_info->on_disk = 0;
-      evicting_page->ref_ct++;
-      curr_info->present = 1;
-      curr_info->ppn = ppn;
-      update_swap_ref_ct(-1, swap_array_index);
-      vspaceinvalidate(&p->vspace);
-    } else {
-      if (curr_info->present != 1 || curr_info->ppn != ppn) {
-        continue;  // different page
-      }
-      // affected page
-      curr_info->present = in;
-      curr_info->on_disk = swap_array_index;
-      evicting_page->ref_ct--;
-      curr_info->ppn = 0;
-      update_swap_ref_ct(1, swap_array_index);
-      vspacemarknotpresent(&p->vspace, va);
-    }
-    // vspaceinvalidate(&p->vspace);
-
-  }
-  if (lk) {
-    release(&ptable.lock);
-  }
-  if (evicting_page->ref_ct != 0 && !in) {
-    return -1;
-  }
-  return 0;
-}
@@ -0,0 +1,235 @@
+// Reverse mappings from physical frames and swap slots to the
+// virtual pages that refer to them.
+//
+// Every frame that backs user memory, and every swap slot holding a
+// swapped-out user page, keeps a list of (page table, va, vpage_info)
+// entries, one per page that maps it. Entries name the page table
+// rather than the vspace struct, which moves (see vspacemove), while
+// a vspace keeps its page table for life. Eviction and swap-in walk that
+// list instead of searching every process, so their cost is
+// proportional to the number of sharers, and sharers may map the
+// frame at different virtual addresses. A shared memory object's own
+// entries have no page table (see shm.c) and no PTE to update.
+//
+// Invariants: a frame's list has ref_ct entries and a slot's list has
+// swap_status[].ref_ct entries, except while a mapping is being
+// created or torn down.
+//
+// rmaplock protects all lists and the entry pool. It is taken after
+// kmem.lock, and nothing is allocated while it is held. The pages'
+// own locks (vpi_lock()) are taken inside it to change a page.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <fs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <vspace.h>
+#include <x86_64.h>
+#include <x86_64vm.h>
+
+extern struct swap_stat swap_status[SWAPSIZE_PAGES];
+
+static struct spinlock rmaplock;
+static struct rmap *rmap_freelist; // unused entries, carved from whole pages
+
+void rmapinit(void) { initlock(&rmaplock, "rmap"); }
+
+// Returns an unused entry with rmaplock held, carving a new page
+// into entries if the pool is empty. Returns 0, without the lock,
+// if no page can be had.
+static struct rmap *rmap_alloc(void) {
+  struct rmap *e;
+  char *mem;
+  int i;
+
+  acquire(&rmaplock);
+  while (!rmap_freelist) {
+    release(&rmaplock);
+    if ((mem = kalloc()) == 0)
+      return 0;
+    acquire(&rmaplock);
+    e = (struct rmap *)mem;
+    for (i = 0; i < PGSIZE / sizeof(struct rmap); i++, e++) {
+      e->next = rmap_freelist;
+      rmap_freelist = e;
+    }
+  }
+  e = rmap_freelist;
+  rmap_freelist = e->next;
+  return e;
+}
+
+static int rmap_insert(struct rmap **head, struct vspace *vs, uint64_t va,
+                       struct vpage_info *vpi) {
+  struct rmap *e;
+
+  if ((e = rmap_alloc()) == 0)
+    return -1;
+  e->pgtbl = vs->pgtbl;
+  e->va = va;
+  e->vpi = vpi;
+  e->next = *head;
+  *head = e;
+  release(&rmaplock);
+  return 0;
+}
+
+static void rmap_delete(struct rmap **head, struct vpage_info *vpi) {
+  struct rmap **pp, *e;
+
+  acquire(&rmaplock);
+  for (pp = head; (e = *pp) != 0; pp = &e->next) {
+    if (e->vpi == vpi) {
+      *pp = e->next;
+      e->next = rmap_freelist;
+      rmap_freelist = e;
+      release(&rmaplock);
+      return;
+    }
+  }
+  panic("rmap_delete: no such mapping");
+}
+
+// records that vpi, at va in vs, maps physical page ppn
+int rmap_add(uint64_t ppn, struct vspace *vs, uint64_t va,
+             struct vpage_info *vpi) {
+  return rmap_insert(&pa2page(ppn << PT_SHIFT)->rmap, vs, va, vpi);
+}
+
+// forgets that vpi maps physical page ppn
+void rmap_del(uint64_t ppn, struct vpage_info *vpi) {
+  rmap_delete(&pa2page(ppn << PT_SHIFT)->rmap, vpi);
+}
+
+// records that vpi, at va in vs, was swapped out to slot
+int rmap_add_swap(int slot, struct vspace *vs, uint64_t va,
+                  struct vpage_info *vpi) {
+  return rmap_insert(&swap_status[slot].rmap, vs, va, vpi);
+}
+
+// Forgets vpi's mapping, whether it is in memory or swapped out,
+// deciding which under rmaplock so it cannot race with swapping.
+// Returns 1 and sets *ppn if vpi mapped a frame, or 0 and sets *slot
+// if it was swapped out; the caller drops that reference.
+int rmap_remove(struct vpage_info *vpi, uint64_t *ppn, int *slot) {
+  struct rmap **head, **pp, *e;
+  int present;
+
+  acquire(&rmaplock);
+  present = vpi->present;
+  if (present) {
+    *ppn = vpi->ppn;
+    head = &pa2page((uint64_t)vpi->ppn << PT_SHIFT)->rmap;
+  } else {
+    *slot = vpi->on_disk;
+    head = &swap_status[vpi->on_disk].rmap;
+  }
+  for (pp = head; (e = *pp) != 0; pp = &e->next) {
+    if (e->vpi == vpi) {
+      *pp = e->next;
+      e->next = rmap_freelist;
+      rmap_freelist = e;
+      release(&rmaplock);
+      return present;
+    }
+  }
+  panic("rmap_remove: no such mapping");
+}
+
+// Drops the TLB entry for va from every cpu running in its address
+// space, so that the next touch from any of them sets the accessed
+// bit again and the page does not look idle while in use.
+static void rmap_flush(struct rmap *e) {
+  if (e->pgtbl)
+    tlbshootdown(e->pgtbl, e->va);
+}
+
+// Reads and clears the accessed bit in every mapping of frame.
+// Returns 1 if any of them was touched since the last call.
+int rmap_test_clear_accessed(struct core_map_entry *frame) {
+  struct rmap *e;
+  pte_t *pte;
+  int accessed = 0;
+
+  acquire(&rmaplock);
+  for (e = frame->rmap; e; e = e->next) {
+    pte = e->pgtbl ? walkpml4(e->pgtbl, (char *)e->va, 0) : 0;
+    if (pte && (*pte & PTE_A)) {
+      accessed = 1;
+      // atomic: another cpu may be setting PTE_D, or rewriting the
+      // PTE under the page's lock
+      __sync_fetch_and_and(pte, ~(pte_t)PTE_A);
+      rmap_flush(e);
+    }
+  }
+  release(&rmaplock);
+  return accessed;
+}
+
+// Unmaps frame from every page that maps it and points those pages
+// at swap slot instead; the caller writes the data out and accounts
+// for the slot's new references. Returns the number of mappers, or
+// -1 (changing nothing) if some references to frame are not mappings.
+// The frame's count is dropped to 0 first, with a compare-and-swap, so
+// that a reference taken for a new mapping meanwhile makes this fail
+// and one taken after it fails (see try_increment_pp_ref_ct).
+int rmap_swap_out(struct core_map_entry *frame, int slot) {
+  struct rmap *e;
+  pte_t *pte;
+  int n = 0;
+
+  acquire(&rmaplock);
+  for (e = frame->rmap; e; e = e->next)
+    n++;
+  if (n == 0 || !__sync_bool_compare_and_swap(&frame->ref_ct, n, 0)) {
+    release(&rmaplock);
+    return -1;
+  }
+
+  for (e = frame->rmap; e; e = e->next) {
+    acquire(vpi_lock(e->vpi));
+    e->vpi->present = 0;
+    e->vpi->ppn = 0;
+    e->vpi->on_disk = slot;
+    if (e->pgtbl && (pte = walkpml4(e->pgtbl, (char *)e->va, 0)) != 0) {
+      *pte = 0;
+      tlbshootdown(e->pgtbl, e->va);
+    }
+    release(vpi_lock(e->vpi));
+  }
+  swap_status[slot].rmap = frame->rmap;
+  frame->rmap = 0;
+  release(&rmaplock);
+  return n;
+}
+
+// Points every page swapped out to slot at frame, which already
+// holds their data. Page tables are left alone; each mapper installs
+// its PTE on its next fault. Returns the number of pages, which may
+// be 0 if someone else brought them back in first. The frame's count
+// is set before any page points at it, as a page's references may
+// be taken as soon as it does.
+int rmap_swap_in(int slot, struct core_map_entry *frame) {
+  struct rmap *e;
+  int n = 0;
+
+  acquire(&rmaplock);
+  for (e = swap_status[slot].rmap; e; e = e->next)
+    n++;
+  frame->ref_ct = n;
+  for (e = swap_status[slot].rmap; e; e = e->next) {
+    acquire(vpi_lock(e->vpi));
+    e->vpi->present = 1;
+    e->vpi->ppn = PGNUM(page2pa(frame));
+    e->vpi->on_disk = 0;
+    release(vpi_lock(e->vpi));
+  }
+  frame->rmap = swap_status[slot].rmap;
+  swap_status[slot].rmap = 0;
+  release(&rmaplock);
+  return n;
+}
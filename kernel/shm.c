@@ -0,0 +1,183 @@
+// Shared memory objects.
+//
+// shm_open() names a set of zero-filled pages that any process can
+// then map with shm_map(), so that processes pass data through the
+// same frames instead of copying it through a pipe.
+//
+// An object keeps its pages in an address space of its own that has
+// no page table. Its region holds a reference to each frame and a
+// reverse mapping, like any other mapper, and a process that maps the
+// object copies those as fork copies a MAP_SHARED region. Frame
+// reference counts therefore match the reverse mappings, and eviction
+// swaps an object's pages out and in for all its mappers at once.
+//
+// An object lives until it is unlinked and its last mapping is gone.
+// shmtable.lock protects the table; the pages are allocated and freed
+// without it, while the object is marked busy.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <mmu.h>
+#include <param.h>
+#include <proc.h>
+#include <spinlock.h>
+#include <vspace.h>
+
+#define SHM_NAMELEN 16
+
+struct shm {
+  char name[SHM_NAMELEN]; // "" once unlinked
+  int ref;                // mappings, plus one while it has a name
+  int busy;               // its pages are being allocated or freed
+  struct vspace vs;       // its pages, in regions[VR_CODE]; no page table
+};
+
+struct {
+  struct spinlock lock;
+  struct shm shm[NSHM];
+} shmtable;
+
+void shminit(void) { initlock(&shmtable.lock, "shm"); }
+
+// returns the named object, waiting out one being set up, or 0;
+// unlinked objects have no name and are never found.
+// called with shmtable.lock held
+static struct shm *shmlookup(char *name) {
+  struct shm *s;
+
+  for (s = shmtable.shm; s < &shmtable.shm[NSHM]; s++) {
+    if (s->ref > 0 && s->name[0] != 0 &&
+        strncmp(s->name, name, SHM_NAMELEN) == 0) {
+      while (s->busy)
+        sleep(s, &shmtable.lock);
+      // it may have failed to set up, or been unlinked meanwhile
+      if (s->ref == 0 || s->name[0] == 0 ||
+          strncmp(s->name, name, SHM_NAMELEN) != 0)
+        return 0;
+      return s;
+    }
+  }
+  return 0;
+}
+
+// Returns the id of the object called name, creating it with size
+// bytes of zeroed pages if there is none. Returns -1 if an existing
+// object is smaller than size, or a new one cannot be made.
+int shmopen(char *name, int size) {
+  struct shm *s;
+  struct vregion *vr;
+
+  if (name[0] == 0 || size <= 0 || size > SHMMAXPAGES * PGSIZE)
+    return -1;
+
+  acquire(&shmtable.lock);
+  if ((s = shmlookup(name)) == 0) {
+    for (s = shmtable.shm; s < &shmtable.shm[NSHM]; s++)
+      if (s->ref == 0 && !s->busy)
+        break;
+    if (s == &shmtable.shm[NSHM]) {
+      release(&shmtable.lock);
+      return -1;
+    }
+    safestrcpy(s->name, name, SHM_NAMELEN);
+    s->ref = 1;
+    s->busy = 1;
+    release(&shmtable.lock);
+
+    memset(&s->vs, 0, sizeof(s->vs));
+    vr = &s->vs.regions[VR_CODE];
+    vr->dir = VRDIR_UP;
+    vr->size = PGROUNDUP(size);
+    if (vregionaddmap(&s->vs, vr, 0, vr->size, VPI_PRESENT, VPI_WRITABLE) < 0) {
+      vspacefree(&s->vs);
+      acquire(&shmtable.lock);
+      s->name[0] = 0;
+      s->ref = 0;
+      s->busy = 0;
+      wakeup(s);
+      release(&shmtable.lock);
+      return -1;
+    }
+
+    acquire(&shmtable.lock);
+    s->busy = 0;
+    wakeup(s);
+    release(&shmtable.lock);
+    return s - shmtable.shm;
+  }
+  if (s->vs.regions[VR_CODE].size < size) {
+    release(&shmtable.lock);
+    return -1;
+  }
+  release(&shmtable.lock);
+  return s - shmtable.shm;
+}
+
+// Maps object id into the current process, at va if that is free.
+// Returns the address of the mapping, or -1.
+int64_t shmmap(int id, uint64_t va) {
+  struct shm *s;
+
+  if (id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtable.shm[id];
+  acquire(&shmtable.lock);
+  while (s->busy)
+    sleep(s, &shmtable.lock);
+  if (s->ref == 0) {
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->ref++;
+  release(&shmtable.lock);
+
+  if (vspacemapshm(&myproc()->vspace, &va, s, &s->vs.regions[VR_CODE]) < 0) {
+    shmrelease(s);
+    return -1;
+  }
+  return va;
+}
+
+// Removes name; the object goes once its last mapping does.
+// Returns -1 if there is no such object.
+int shmunlink(char *name) {
+  struct shm *s;
+
+  if (name[0] == 0)
+    return -1;
+
+  acquire(&shmtable.lock);
+  if ((s = shmlookup(name)) == 0) {
+    release(&shmtable.lock);
+    return -1;
+  }
+  s->name[0] = 0;
+  release(&shmtable.lock);
+  shmrelease(s);
+  return 0;
+}
+
+// takes a reference to s for a new mapping of it
+void shmdup(struct shm *s) {
+  acquire(&shmtable.lock);
+  s->ref++;
+  release(&shmtable.lock);
+}
+
+// Drops a reference to s, freeing its pages with the last one.
+void shmrelease(struct shm *s) {
+  acquire(&shmtable.lock);
+  if (--s->ref > 0) {
+    release(&shmtable.lock);
+    return;
+  }
+  s->busy = 1;
+  release(&shmtable.lock);
+
+  vspacefree(&s->vs);
+
+  acquire(&shmtable.lock);
+  s->busy = 0;
+  wakeup(s);
+  release(&shmtable.lock);
+}
@@ -8,6 +8,7 @@
 #include <proc.h>
 #include <spinlock.h>
 #include <x86_64.h>
+#include <x86_64vm.h>
 
 void initlock(struct spinlock *lk, char *name) {
   lk->name = name;
@@ -24,9 +25,10 @@ void acquire(struct spinlock *lk) {
   if (holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
+  // The xchg is atomic. The holder may be waiting for this cpu
+  // to flush its TLB (see tlbshootdown).
   while (xchg(&lk->locked, 1) != 0)
-    ;
+    tlbflushack();
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -111,6 +111,10 @@ int argptr(int n, char **pp, int size) {
   v = &myproc()->vspace;
   for (r = v->regions; r < &v->regions[NREGIONS]; r++) {
     if (vregioncontains(r, i, size)) {
+      // the buffer may be used under a spinlock; read in any of it
+      // that is still in the executable now
+      if (vspacefillrange(v, i, size) < 0)
+        return -1;
       *pp = (char*)i;
       return 0;
     }
@@ -120,8 +124,9 @@ int argptr(int n, char **pp, int size) {
 
 // Fetch the nth word-sized system call argument as a string pointer.
 // Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
+// (Only a MAP_SHARED mapping can be written by another process, which
+// could change the string between this check and its use; processes
+// that share memory are trusted not to do that to each other.)
 int argstr(int n, char **pp) {
   int addr;
   if (argint(n, &addr) < 0)
@@ -148,6 +153,16 @@ extern int sys_uptime(void);
 extern int sys_sysinfo(void);
 extern int sys_crashn(void);
 extern int sys_unlink(void);
+extern int sys_setwmark(void);
+extern int sys_vfork(void);
+extern int sys_spawn(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shm_open(void);
+extern int sys_shm_map(void);
+extern int sys_shm_unlink(void);
+extern int sys_yield(void);
+extern int sys_nice(void);
 
 static int (*syscalls[])(void) = {
     [SYS_fork] = sys_fork,       [SYS_exit] = sys_exit,
@@ -159,7 +174,12 @@ static int (*syscalls[])(void) = {
     [SYS_uptime] = sys_uptime,   [SYS_open] = sys_open,
     [SYS_write] = sys_write,     [SYS_close] = sys_close,
     [SYS_sysinfo] = sys_sysinfo, [SYS_crashn] = sys_crashn,
-    [SYS_unlink] = sys_unlink,
+    [SYS_unlink] = sys_unlink,   [SYS_setwmark] = sys_setwmark,
+    [SYS_vfork] = sys_vfork,     [SYS_spawn] = sys_spawn,
+    [SYS_mmap] = sys_mmap,       [SYS_munmap] = sys_munmap,
+    [SYS_shm_open] = sys_shm_open, [SYS_shm_map] = sys_shm_map,
+    [SYS_shm_unlink] = sys_shm_unlink, [SYS_yield] = sys_yield,
+    [SYS_nice] = sys_nice,
 };
 
 void syscall(void) {
@@ -177,7 +197,7 @@ void syscall(void) {
 int sys_sysinfo(void) {
   struct sys_info *info;
 
-  if (argptr(0, (void *)&info, sizeof(info)) < 0)
+  if (argptr(0, (void *)&info, sizeof(*info)) < 0)
     return -1;
 
   info->pages_in_use = pages_in_use;
@@ -185,6 +205,16 @@ int sys_sysinfo(void) {
   info->free_pages = free_pages;
   info->num_page_faults = num_page_faults;
   info->num_disk_reads = num_disk_reads;
+  kmem_pcp_stats(&info->pcp_hits, &info->pcp_misses);
+  kswapd_stats(&info->wmark_low, &info->wmark_high, &info->kswapd_pages,
+               &info->direct_reclaims);
+  swap_ra_stats(&info->ra_pages, &info->ra_hits, &info->ra_misses);
+  zswap_stats(&info->zswap_pages, &info->zswap_bytes, &info->zswap_pool_used,
+              &info->zswap_pool_size);
+  info->zero_pages = zero_pages;
+  info->zero_read_faults = zero_read_faults;
+  info->zero_write_faults = zero_write_faults;
+  pcache_stats(&info->pcache_pages, &info->pcache_hits, &info->pcache_misses);
 
   return 0;
 }
@@ -9,10 +9,12 @@
 #include <fcntl.h>
 #include <file.h>
 #include <fs.h>
+#include <mman.h>
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
 #include <sleeplock.h>
+#include <spawn.h>
 #include <spinlock.h>
 #include <stat.h>
 
@@ -239,6 +241,137 @@ int sys_exec(void)
   return exec(path, (char**)argv);
 }
 
+/*
+ * arg0: char * [path to the executable file]
+ * arg1: char * [array of strings for arguments]
+ * arg2: struct spawn_action * [file actions, ending with SPAWN_END, or 0]
+ *
+ * starts the executable in a new child process, as fork followed by
+ * exec would, with the parent's open files changed by the file actions.
+ * returns the pid of the child, or -1 if there was an error.
+ *
+ * Error conditions:
+ * any of the exec errors
+ * more than SPAWN_MAXACT actions
+ * an action names a descriptor that is not open in the child by then
+ */
+int sys_spawn(void)
+{
+  char* path;
+  char* argv;
+  int64_t uacts;
+  struct spawn_action* u;
+  struct spawn_action acts[SPAWN_MAXACT + 1];
+  int i;
+
+  if (argstr(0, &path) < 0 || argptr(1, &argv, sizeof(char*)) < 0 ||
+      argint64(2, &uacts) < 0) {
+    return -1;
+  }
+
+  // copy the actions in, so the user cannot change them underneath us
+  u = (struct spawn_action*)uacts;
+  for (i = 0; u != NULL; i++) {
+    if (fetchint((uint64_t)&u[i].op, &acts[i].op) < 0)
+      return -1;
+    // the terminator may follow SPAWN_MAXACT actions
+    if (acts[i].op == SPAWN_END)
+      break;
+    if (i == SPAWN_MAXACT)
+      return -1;
+    if (fetchint((uint64_t)&u[i].fd, &acts[i].fd) < 0 ||
+        fetchint((uint64_t)&u[i].newfd, &acts[i].newfd) < 0)
+      return -1;
+  }
+  acts[i].op = SPAWN_END;
+
+  return spawn(path, (char**)argv, acts);
+}
+
+/*
+ * arg0: void * [where to map, a hint]
+ * arg1: int [number of bytes to map]
+ * arg2: int [PROT_READ, optionally with PROT_WRITE]
+ * arg3: int [MAP_SHARED or MAP_PRIVATE, optionally with MAP_ANON]
+ * arg4: int [file descriptor to map, unless MAP_ANON]
+ * arg5: int [offset in the file, a multiple of the page size]
+ *
+ * maps arg1 bytes of the file open at arg4, from offset arg5, or of
+ * zero-filled memory, into the address space. arg0 is used if it is
+ * page aligned and free; otherwise the kernel picks the address.
+ * File pages are read in when first touched, and those past the end
+ * of the file read as zero.
+ *
+ * With MAP_SHARED, children forked later see the same memory, and
+ * writes to a file mapping are written back to the file, without
+ * growing it, when it is unmapped or the process exits or execs.
+ * With MAP_PRIVATE, writes are seen by no one else.
+ *
+ * returns the address of the mapping, or MAP_FAILED.
+ *
+ * Error conditions:
+ * arg1 is not positive
+ * arg2 or arg3 has an unknown bit, or not exactly one of MAP_SHARED
+ * and MAP_PRIVATE is given
+ * arg4 is not a file open for reading (and writing, for a shared
+ * writable mapping)
+ * arg5 is not page aligned
+ * all NMMAP mappings are in use, or there is no room for this one
+ */
+int sys_mmap(void)
+{
+  int64_t addr;
+  int len, prot, flags, fd, off;
+  struct inode* ip = NULL;
+  uint64_t va;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+      argint(3, &flags) < 0 || argint(4, &fd) < 0 || argint(5, &off) < 0)
+    return -1;
+  if (len <= 0 || (prot & ~(PROT_READ | PROT_WRITE)) != 0 ||
+      (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANON)) != 0 ||
+      !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE))
+    return -1;
+
+  if (!(flags & MAP_ANON)) {
+    if (fd < 0 || fd >= NOFILE || off < 0 || off % PGSIZE != 0)
+      return -1;
+    ip = file_inode(fd, (flags & MAP_SHARED) && (prot & PROT_WRITE));
+    if (ip == NULL)
+      return -1;
+  }
+
+  va = addr;
+  if (vspacemmap(&myproc()->vspace, &va, len, prot, flags, ip, off) < 0) {
+    if (ip)
+      irelease(ip);
+    return -1;
+  }
+  return va;
+}
+
+/*
+ * arg0: void * [start of a mapping]
+ * arg1: int [its length]
+ *
+ * removes the mapping made by mmap at arg0, writing it back to its
+ * file first if it is a shared mapping of one.
+ *
+ * returns 0 on success, -1 otherwise.
+ *
+ * Error conditions:
+ * arg0 and arg1 do not describe a whole mapping
+ */
+int sys_munmap(void)
+{
+  int64_t addr;
+  int len;
+
+  if (argint64(0, &addr) < 0 || argint(1, &len) < 0 || len <= 0)
+    return -1;
+  return vspacemunmap(&myproc()->vspace, addr, len);
+}
+
 int sys_pipe(void)
 {
   int* res;
@@ -5,6 +5,7 @@
 #include <mmu.h>
 #include <param.h>
 #include <proc.h>
+#include <timer.h>
 #include <x86_64.h>
 
 int sys_crashn(void) {
@@ -18,8 +19,19 @@ int sys_crashn(void) {
   return 0;
 }
 
+// sets the free-page watermarks kswapd works between
+int sys_setwmark(void) {
+  int low, high;
+  if (argint(0, &low) < 0 || argint(1, &high) < 0)
+    return -1;
+
+  return kswapd_setwmark(low, high);
+}
+
 int sys_fork(void) { return fork(); }
 
+int sys_vfork(void) { return vfork(); }
+
 void halt(void) {
   while (1)
     ;
@@ -41,6 +53,21 @@ int sys_kill(void) {
 
 int sys_getpid(void) { return myproc()->pid; }
 
+// gives up the cpu to the next runnable process
+int sys_yield(void) {
+  yield();
+  return 0;
+}
+
+// adds arg0 to the nice value; returns the new value
+int sys_nice(void) {
+  int inc;
+
+  if (argint(0, &inc) < 0)
+    return -1;
+  return nice(inc);
+}
+
 /*
  * arg0: integer value of amount of memory to be added to the heap. If arg0 < 0, treat it as 0.
  *
@@ -61,27 +88,64 @@ int sys_sbrk(void) {
   if (vs.regions[VR_USTACK].va_base - 10 * PGSIZE  // stack limit
       <= vs.regions[VR_HEAP].va_base + vs.regions[VR_HEAP].size + n ||
       vs.regions[VR_USTACK].va_base - 10 * PGSIZE
-      <= PGROUNDUP(vs.regions[VR_HEAP].va_base + vs.regions[VR_HEAP].size)) {  // projected upper bound
+      <= PGROUNDUP(vs.regions[VR_HEAP].va_base + vs.regions[VR_HEAP].size) ||  // projected upper bound
+      vspaceoverlap(&vs, PGROUNDUP(VRTOP(&vs.regions[VR_HEAP])), PGROUNDUP(n))) {  // an mmap region
     cprintf("***too big to allocate\n");
     return -1;
   }
   return sbrk(n);
 }
 
+// opens the shared memory object named arg0, creating it with arg1
+// bytes of zeroed memory if it does not exist; returns its id or -1
+int sys_shm_open(void) {
+  char *name;
+  int size;
+
+  if (argstr(0, &name) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmopen(name, size);
+}
+
+// maps shared memory object arg0 at arg1 if that is free, or
+// wherever it fits; returns the address or -1. munmap() takes the
+// object's size.
+int sys_shm_map(void) {
+  int id;
+  int64_t va;
+
+  if (argint(0, &id) < 0 || argint64(1, &va) < 0)
+    return -1;
+  return shmmap(id, va);
+}
+
+// removes the name arg0; the object lives on until it is unmapped
+int sys_shm_unlink(void) {
+  char *name;
+
+  if (argstr(0, &name) < 0)
+    return -1;
+  return shmunlink(name);
+}
+
+// sleeps for arg0 ticks; a timer wakes the process once they are up
 int sys_sleep(void) {
+  struct timer t;
   int n;
-  uint ticks0;
 
   if (argint(0, &n) < 0)
     return -1;
+  if (n <= 0)
+    return 0;
   acquire(&tickslock);
-  ticks0 = ticks;
-  while (ticks - ticks0 < n) {
+  timer_add(&t, ticks + n, wakeup, &t);
+  while (t.pending) {
     if (myproc()->killed) {
+      timer_del(&t);
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleep(&t, &tickslock);
   }
   release(&tickslock);
   return 0;
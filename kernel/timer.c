@@ -0,0 +1,71 @@
+// Kernel timers.
+//
+// A timer runs a callback once, at a given tick. Timers are kept on
+// a hashed timing wheel: NSLOTS lists, a timer going on the list of
+// its expiry tick modulo NSLOTS. Each tick looks only at the list for
+// that tick, so it costs the number of timers on it, not the number
+// of timers, and a sleeper is woken once, when it is due, instead
+// of on every tick. A timer due more than NSLOTS ticks out stays on
+// its list for the rotations before then.
+//
+// tickslock protects the wheel. Callers of timer_add and timer_del
+// must hold it, and callbacks run with it held from the timer
+// interrupt, so they must not sleep; wakeup() is the usual one.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <spinlock.h>
+#include <timer.h>
+
+#define NSLOTS 256
+
+static struct timer *wheel[NSLOTS];
+
+// Arranges for fn(arg) to run at tick expires, or on the next tick
+// if that has passed.
+void timer_add(struct timer *t, uint expires, void (*fn)(void *), void *arg) {
+  struct timer **slot;
+
+  if (!holding(&tickslock))
+    panic("timer_add");
+  if ((int)(expires - ticks) <= 0)
+    expires = ticks + 1;
+  t->expires = expires;
+  t->fn = fn;
+  t->arg = arg;
+  t->pending = 1;
+  slot = &wheel[expires % NSLOTS];
+  t->next = *slot;
+  *slot = t;
+}
+
+// Cancels t. Returns 1 if it had yet to run.
+int timer_del(struct timer *t) {
+  struct timer **pp;
+
+  if (!holding(&tickslock))
+    panic("timer_del");
+  if (!t->pending)
+    return 0;
+  for (pp = &wheel[t->expires % NSLOTS]; *pp != t; pp = &(*pp)->next)
+    ;
+  *pp = t->next;
+  t->pending = 0;
+  return 1;
+}
+
+// Runs the timers due at this tick. Called on each tick, with
+// tickslock held, after ticks has been advanced.
+void timer_tick(void) {
+  struct timer **pp, *t;
+
+  for (pp = &wheel[ticks % NSLOTS]; (t = *pp) != 0;) {
+    if (t->expires != ticks) { // due on a later rotation
+      pp = &t->next;
+      continue;
+    }
+    *pp = t->next;
+    t->pending = 0;
+    t->fn(t->arg);
+  }
+}
@@ -7,6 +7,7 @@
 #include <spinlock.h>
 #include <trap.h>
 #include <x86_64.h>
+#include <x86_64vm.h>
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gate_desc idt[256];
@@ -50,8 +51,10 @@ void trap(struct trap_frame *tf) {
     if (cpunum() == 0) {
       acquire(&tickslock);
       ticks++;
-      wakeup(&ticks);
+      timer_tick();
       release(&tickslock);
+      if (ticks % BOOSTTICKS == 0)
+        schedboost();
     }
     lapiceoi();
     break;
@@ -70,6 +73,10 @@ void trap(struct trap_frame *tf) {
     uartintr();
     lapiceoi();
     break;
+  case TRAP_IRQ0 + IRQ_TLBFLUSH:
+    tlbflushack();
+    lapiceoi();
+    break;
   case TRAP_IRQ0 + 7:
   case TRAP_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n", cpunum(), tf->cs, tf->rip);
@@ -80,26 +87,46 @@ void trap(struct trap_frame *tf) {
     addr = rcr2();
 
     if (tf->trapno == TRAP_PF) {
-      num_page_faults += 1;
+      __sync_fetch_and_add(&num_page_faults, 1);
 
       // lab5: check if swap in is needed
       struct vregion* vr = va2vregion(&myproc()->vspace, addr);
-      if (vr) {
-        struct vpage_info* curr_info = va2vpage_info(vr, addr);
-        if (curr_info->used && !curr_info->present) { // same as used but not present
-          if (swap_in(curr_info->on_disk, addr) != -1) {
-            vspaceinstall(myproc());
+      struct vpage_info* curr_info = vr ? vregionlookup(vr, addr) : 0;
+      if (curr_info) {
+        // first touch of a page of the program, still in the executable;
+        // if it cannot be read in, the process is killed below
+        if (curr_info->used && curr_info->file) {
+          if (vspacefillpage(&myproc()->vspace, addr) != -1)
+            return;
+          goto bad_fault;
+        }
+        // first read of a demand-zero heap page; writes go to copy-on-write below
+        if (curr_info->used && curr_info->zero && !curr_info->present && !(tf->err & 2)) {
+          if (vspacemapzero(&myproc()->vspace, addr) != -1)
+            return;
+        }
+        if (curr_info->used && !curr_info->present && !curr_info->zero &&
+            !curr_info->file) { // same as used but not present
+          if (vspaceswapin(&myproc()->vspace, addr) != -1)
             return;
-          }
           else panic("swap in failed\n");
         }
+        // another process sharing the page swapped it back in, or it
+        // was read ahead, so only our page table is missing the frame
+        pte_t* pte = walkpml4(myproc()->vspace.pgtbl, (char*)addr, 0);
+        if (curr_info->used && curr_info->present && (!pte || !(*pte & PTE_P))) {
+          if (swap_ra_hit((uint64_t)curr_info->ppn << PT_SHIFT))
+            myproc()->vspace.ra_hits++;
+          if (vspaceupdate(&myproc()->vspace, addr, PGSIZE) < 0)
+            panic("soft fault: no memory for page table");
+          return;
+        }
       }
 
       // lab3: check if it caused by copy on write
       if (validate_cow(addr) == 0 && (tf->err & 2)) {
         // it is caused by copy on write
         if (vspace_copy_on_write(&myproc()->vspace, addr) != -1) { // implemented in vspace.c
-          vspaceinstall(myproc());
           return;
         } else {
           panic("err in vspace_copy_on_write");
@@ -113,6 +140,7 @@ void trap(struct trap_frame *tf) {
         else panic("err in grow_user_stack_ondemand");
       }
 
+    bad_fault:
       if (myproc() == 0 || (tf->cs & 3) == 0) {
         // In kernel, it must be our mistake.
         cprintf("unexpected trap %d from cpu %d rip %lx (cr2=0x%x)\n",
@@ -135,10 +163,11 @@ void trap(struct trap_frame *tf) {
   if (myproc() && myproc()->killed && (tf->cs & 3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU on clock tick, once its time slice
+  // is up or a process of higher priority is waiting.
   // If interrupts were on while locks held, would need to check nlock.
   if (myproc() && myproc()->state == RUNNING &&
-      tf->trapno == TRAP_IRQ0 + IRQ_TIMER)
+      tf->trapno == TRAP_IRQ0 + IRQ_TIMER && schedtick())
     yield();
 
   // Check if the process has been killed since we yielded
@@ -160,7 +189,7 @@ int validate_cow(uint64_t addr) {
       return -1;
     }
   }
-  struct vpage_info* curr_page = va2vpage_info(curr_region, addr);
+  struct vpage_info* curr_page = vregionlookup(curr_region, addr);
   if (curr_page == 0) {
     return -1;
   }
@@ -176,9 +205,9 @@ int grow_user_stack_ondemand(uint64_t addr) {
   uint64_t n = PGROUNDUP(prev_limit - addr);
   if (stack->size + n >= 10 * PGSIZE) return -1;
   // vregionaddmap handles everything including rounding to see if calling kalloc is needed
-  int size = vregionaddmap(stack, prev_limit - n, n, VPI_PRESENT, VPI_WRITABLE);
+  int size = vregionaddmap(&myproc()->vspace, stack, prev_limit - n, n, VPI_PRESENT, VPI_WRITABLE);
   if (size < 0) return -1;
   stack->size += size;
-  vspaceinvalidate(&(myproc()->vspace));
+  if (vspaceupdate(&myproc()->vspace, prev_limit - n, n) < 0) return -1;
   return prev_limit;
 }
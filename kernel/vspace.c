@@ -1,7 +1,10 @@
 #include <cdefs.h>
 #include <defs.h>
 #include <elf.h>
+#include <file.h>
+#include <fs.h>
 #include <memlayout.h>
+#include <mman.h>
 #include <vspace.h>
 #include <proc.h>
 #include <x86_64.h>
@@ -22,12 +25,14 @@ va2vpi_idx(struct vregion *r, uint64_t va)
 
 // given a reference to a vpage_info struct
 // returns its permissions with respect to the
-// user bit, present bit, and writable bit
+// user bit, present bit, and writable bit.
+// A page read ahead from swap is left unmapped until its
+// first touch, so that the touch can be counted as a hit.
 static int
 x86perms(struct vpage_info *vpi)
 {
   int perms = PTE_U; // always user if in a virtual region
-  if (vpi->present)
+  if (vpi->present && !pa2page((uint64_t)vpi->ppn << PT_SHIFT)->ra)
     perms |= PTE_P;
   if (vpi->writable)
     perms |= PTE_W;
@@ -36,15 +41,44 @@ x86perms(struct vpage_info *vpi)
 
 extern pml4e_t *kpml4;  // kernel page table
 
+#define INVLPG_MAX 32 // vspaceupdate flushes the whole TLB past this many pages
+#define VPI_NLOCKS 64 // stripes of vpage_info locks
+
+// vpage_infos are too small to carry a lock each. A page is guarded
+// instead by one of VPI_NLOCKS locks picked by its descriptor's
+// address, so neighbouring pages use different locks. rmap.c takes
+// them too, after rmaplock, so nothing is allocated and no reverse
+// mapping changed while one is held.
+static struct spinlock vpi_locks[VPI_NLOCKS];
+
+struct spinlock *
+vpi_lock(struct vpage_info *vpi)
+{
+  return &vpi_locks[((uint64_t)vpi / sizeof(*vpi)) % VPI_NLOCKS];
+}
+
+// The shared zero page. Demand-zero heap pages map it read-only until
+// they are first written. It is never freed or swapped out (it has no
+// reverse mappings), and takes no references.
+static char *zero_page;
+int zero_pages;        // demand-zero pages not backed by a private frame
+int zero_read_faults;  // faults that mapped the zero page
+int zero_write_faults; // faults that gave a demand-zero page its own frame
+
 // allocates space for the kernel page table and populates
 // it with the kernel's virtual address mapping after the
 // virtual address space has been initialized by the kernel
 void
 vspacebootinit(void)
 {
-  kpml4 = setupkvm(); // sets up the kernel's page table
+  int i;
+
+  for (i = 0; i < VPI_NLOCKS; i++)
+    initlock(&vpi_locks[i], "vpage_info");
+  kvmalloc(); // sets up the kernel's page table
+  assertm(zero_page = kalloc(), "no memory for the zero page");
+  memset(zero_page, 0, PGSIZE);
   vspaceinstallkern();  // installs the kernel mapping in the table
-  seginit();   // segment table
 }
 
 // initializes a given vspace struct, by creating the page table
@@ -67,14 +101,63 @@ vspaceinit(struct vspace *vs)
   vs->regions[VR_HEAP].dir   = VRDIR_UP;
   vs->regions[VR_USTACK].dir = VRDIR_DOWN;
 
+  vs->ra_window = 2;
+  vs->ra_last = 0;
+  vs->ra_hits = 0;
+
+  vs->ip = 0;
+  vs->nsegs = 0;
+
   return 0;
 }
 
-// Adds a mapping in the vregion from the virtual address from_va of size sz with the appropriate
-// permissions. If size spans more than one page, multiple physical pages are mapped into the
-// page table
+// Swaps the page at va back in, along with the pages above it that
+// sit in the following swap slots, up to the vspace's readahead
+// window. The window doubles while the pages read ahead last time
+// all got used, and halves when none of them did.
+// Returns -1 if the page could not be swapped in.
 int
-vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present, short writable)
+vspaceswapin(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t slot;
+  int n, ret;
+
+  va = PGROUNDDOWN(va);
+  if (!(vr = va2vregion(vs, va)) || !(vpi = vregionlookup(vr, va)))
+    return -1;
+  slot = vpi->on_disk;
+
+  if (vs->ra_last > 0) {
+    if (vs->ra_hits >= vs->ra_last)
+      vs->ra_window = min(vs->ra_window * 2, SWAP_CLUSTER);
+    else if (vs->ra_hits == 0)
+      vs->ra_window = max(vs->ra_window / 2, 1);
+  }
+
+  for (n = 1; n < vs->ra_window; n++) {
+    if (slot + n >= SWAPSIZE_PAGES || !vregioncontains(vr, va + n * PGSIZE, PGSIZE))
+      break;
+    vpi = vregionlookup(vr, va + n * PGSIZE);
+    if (!vpi || !vpi->used || vpi->present || vpi->zero || vpi->file ||
+        vpi->on_disk != slot + n)
+      break;
+  }
+
+  if ((ret = swap_in(slot, n)) < 0)
+    return -1;
+  vs->ra_last = ret - 1;
+  vs->ra_hits = 0;
+  // the pages read ahead stay unmapped until touched
+  return vspaceupdate(vs, va, PGSIZE);
+}
+
+// Adds a mapping in the vregion of vs from the virtual address from_va of size sz with the
+// appropriate permissions. If size spans more than one page, multiple physical pages are mapped
+// into the page table
+int
+vregionaddmap(struct vspace *vs, struct vregion *vr, uint64_t from_va, uint64_t sz, short present, short writable)
 {
   char *mem;
   uint64_t a;
@@ -92,68 +175,276 @@ vregionaddmap(struct vregion *vr, uint64_t from_va, uint64_t sz, short present,
     if (!mem)
       goto addmap_failure;
     memset(mem, 0, PGSIZE);
-    acquire(&vpi->lock);
+    acquire(vpi_lock(vpi));
     vpi->used = 1;
     vpi->present = present;
     vpi->writable = writable;
     vpi->ppn = PGNUM(V2P(mem));
-    release(&vpi->lock);
+    release(vpi_lock(vpi));
+    if (rmap_add(vpi->ppn, vs, a, vpi) < 0) {
+      vpi->used = 0;
+      vpi->present = 0;
+      vpi->ppn = 0;
+      kfree(mem);
+      goto addmap_failure;
+    }
   }
   return sz;
 
 addmap_failure:
-  for (a -= PGSIZE; a >= PGROUNDUP(from_va); a -= PGSIZE) {
-    assertm(vpi = va2vpage_info(vr, a), "vpi info missing");
-    kfree(P2V(vpi->ppn << PT_SHIFT));
-    acquire(&vpi->lock);
+  while (a > PGROUNDUP(from_va)) {
+    a -= PGSIZE;
+    assertm(vpi = vregionlookup(vr, a), "vpi info missing");
+    rmap_del(vpi->ppn, vpi);
+    kfree(P2V((uint64_t)vpi->ppn << PT_SHIFT));
+    acquire(vpi_lock(vpi));
     vpi->used = 0;
     vpi->present = 0;
     vpi->writable = 0;
     vpi->ppn = 0;
-    release(&vpi->lock);
+    release(vpi_lock(vpi));
   }
   //cprintf("**********failure!\n");
   return -1;
 }
 
 
-// Adds a mapping into the vregion at va of size sz with the given permissions and then
-// copies the data present in data to these addresses
-static int
-vradddata(struct vregion *r, uint64_t va, char *data, int sz, short present, short writable)
+// Adds demand-zero pages to the vregion from the virtual address from_va
+// of size sz. No memory is allocated: the first read of a page maps the
+// shared zero page, and the first write gives it a private frame.
+int
+vregionaddzero(struct vregion *vr, uint64_t from_va, uint64_t sz)
 {
-  int ret;
-  uint64_t i, n;
+  uint64_t a;
   struct vpage_info *vpi;
 
-  if ((ret = vregionaddmap(r, va, sz, present, writable)) < 0)
-    return ret;
+  if (sz + from_va >= KERNBASE)
+    return -1;
+  if (sz <= 0)
+    return 0;
 
-  for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
-    assert(vpi->used);
-    n = min((uint64_t)sz - i, (uint64_t)PGSIZE);
-    memmove(P2V(vpi->ppn << PT_SHIFT), data + i, n);
+  for (a = PGROUNDUP(from_va); a < from_va + sz; a += PGSIZE) {
+    if (!(vpi = va2vpage_info(vr, a)))
+      goto addzero_failure;
+    acquire(vpi_lock(vpi));
+    vpi->used = 1;
+    vpi->zero = 1;
+    vpi->present = 0;
+    vpi->writable = !VPI_WRITABLE;
+    vpi->copy_on_write = 1;
+    vpi->ppn = 0;
+    release(vpi_lock(vpi));
+    __sync_fetch_and_add(&zero_pages, 1);
+  }
+  return sz;
+
+addzero_failure:
+  while (a > PGROUNDUP(from_va)) {
+    a -= PGSIZE;
+    assertm(vpi = vregionlookup(vr, a), "vpi info missing");
+    acquire(vpi_lock(vpi));
+    vpi->used = 0;
+    vpi->zero = 0;
+    vpi->copy_on_write = 0;
+    release(vpi_lock(vpi));
+    __sync_fetch_and_sub(&zero_pages, 1);
+  }
+  return -1;
+}
+
+// Maps the zero page at va, a demand-zero page being read.
+int
+vspacemapzero(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+
+  if (!(vr = va2vregion(vs, va)) || !(vpi = vregionlookup(vr, va)))
+    return -1;
+  acquire(vpi_lock(vpi));
+  if (!vpi->zero) {
+    release(vpi_lock(vpi));
+    return -1;
   }
+  vpi->present = 1;
+  vpi->ppn = PGNUM(V2P(zero_page));
+  release(vpi_lock(vpi));
+  __sync_fetch_and_add(&zero_read_faults, 1);
+  return vspaceupdate(vs, va, PGSIZE);
+}
+
+// Reads the code page at va in from the executable's segments,
+// zeroing what they do not cover, or takes it from the page cache.
+// Sets *shared if the frame is cached and so may be mapped by others.
+// Returns the frame, or 0.
+static char *
+vspacereadcode(struct vspace *vs, uint64_t va, int *shared)
+{
+  struct vseg *seg;
+  uint64_t start, end;
+  char *mem;
+
+  // another process running this binary may have read it in already
+  if ((mem = pcache_get(vs->ip->dev, vs->ip->inum, va)) != 0) {
+    *shared = 1;
+    return mem;
+  }
+  if (!(mem = kalloc()))
+    return 0;
+  memset(mem, 0, PGSIZE);
+  locki(vs->ip);
+  for (seg = vs->segs; seg < &vs->segs[vs->nsegs]; seg++) {
+    // the part of this page that seg's file contents cover
+    start = max(va, seg->va);
+    end = min(va + PGSIZE, seg->va + seg->filesz);
+    if (start >= end)
+      continue;
+    if (readi(vs->ip, mem + (start - va), seg->off + (start - seg->va),
+              end - start) != end - start) {
+      unlocki(vs->ip);
+      kfree(mem);
+      return 0;
+    }
+  }
+  unlocki(vs->ip);
+  *shared = pcache_put(vs->ip->dev, vs->ip->inum, va, mem);
+  return mem;
+}
+
+// Reads the page at va of the mmap region vr in from its file. The
+// part of the page past the end of the file is zero. Returns the
+// frame, or 0.
+static char *
+vregionreadfile(struct vregion *vr, uint64_t va)
+{
+  uint64_t off = vr->off + (va - vr->va_base);
+  char *mem;
+
+  if (!(mem = kalloc()))
+    return 0;
+  memset(mem, 0, PGSIZE);
+  locki(vr->ip);
+  if (off < vr->ip->size && readi(vr->ip, mem, off, PGSIZE) < 0) {
+    unlocki(vr->ip);
+    kfree(mem);
+    return 0;
+  }
+  unlocki(vr->ip);
+  return mem;
+}
+
+// Reads the page at va, which is still in its file (the executable
+// for the code region, the mapped file for an mmap region), in
+// into a frame and maps it. Returns -1 if that cannot be done.
+int
+vspacefillpage(struct vspace *vs, uint64_t va)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  char *mem;
+  int shared = 0;
+
+  va = PGROUNDDOWN(va);
+  if (!(vr = va2vregion(vs, va)))
+    return -1;
+  vpi = vregionlookup(vr, va);
+  if (!vpi || !vpi->used || !vpi->file)
+    return -1;
+
+  if (vr == &vs->regions[VR_CODE])
+    mem = vs->ip ? vspacereadcode(vs, va, &shared) : 0;
+  else
+    mem = vr->ip ? vregionreadfile(vr, va) : 0;
+  if (!mem)
+    return -1;
+
+  if (rmap_add(PGNUM(V2P(mem)), vs, va, vpi) < 0) {
+    kfree(mem);
+    return -1;
+  }
+  acquire(vpi_lock(vpi));
+  vpi->file = 0;
+  // a cached frame is shared: a write gets a private copy
+  if (shared && vpi->writable) {
+    vpi->writable = 0;
+    vpi->copy_on_write = 1;
+  }
+  vpi->ppn = PGNUM(V2P(mem));
+  vpi->present = 1;
+  release(vpi_lock(vpi));
+  return vspaceupdate(vs, va, PGSIZE);
+}
+
+// Reads in the pages of [va, va + size) that are still in their
+// file, so that the kernel can then use the range without a fault
+// that has to sleep (it may hold a spinlock by then).
+// Returns -1 if one cannot be read in.
+int
+vspacefillrange(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a, end;
+
+  if (!(vr = va2vregion(vs, va)))
+    return 0;
+  end = min(va + size, VRTOP(vr));
+  for (a = PGROUNDDOWN(va); a < end; a += PGSIZE)
+    if ((vpi = vregionlookup(vr, a)) && vpi->file &&
+        vspacefillpage(vs, a) < 0)
+      return -1;
   return 0;
 }
 
-// va must be page aligned
+// Copies sz bytes of data to va, which must not cross a page of vs.
+// The page is read or swapped back in first if it is not present,
+// and its lock keeps it from being swapped out again until the copy
+// is done. Returns -1 if the page is not writable or cannot be had.
 static int
-vrloaddata(struct vregion *r, uint64_t va, struct inode *ip, uint offset, uint sz)
+vspacewritepage(struct vspace *vs, uint64_t va, char *data, int sz)
 {
-  uint i, n;
+  struct vregion *vr;
   struct vpage_info *vpi;
-  assertm(va % PGSIZE == 0, "va must be page aligned");
+  int ret;
 
-  for (i = 0; i < sz; i += PGSIZE) {
-    vpi = va2vpage_info(r, va + i);
-    assertm(vpi->used, "page must be allocated");
-    n = min(sz - i, (uint) PGSIZE);
-    if (readi(ip, P2V(vpi->ppn << PT_SHIFT), offset + i, n) != n)
+  if (!(vr = va2vregion(vs, va)) || !(vpi = vregionlookup(vr, va)))
+    return -1;
+  for (;;) {
+    acquire(vpi_lock(vpi));
+    if (!vpi->used || !vpi->writable || (!vpi->present && vpi->zero)) {
+      release(vpi_lock(vpi));
+      return -1;
+    }
+    if (vpi->present)
+      break;
+    release(vpi_lock(vpi));
+    // it may be evicted again before we relock it
+    ret = vpi->file ? vspacefillpage(vs, va) : vspaceswapin(vs, va);
+    if (ret < 0)
       return -1;
   }
+  memmove(P2V((uint64_t)vpi->ppn << PT_SHIFT) + (va % PGSIZE), data, sz);
+  release(vpi_lock(vpi));
+  return 0;
+}
 
+// Adds a mapping into the vregion at va of size sz with the given permissions and then
+// copies the data present in data to these addresses
+static int
+vradddata(struct vspace *vs, struct vregion *r, uint64_t va, char *data, int sz, short present, short writable)
+{
+  int ret;
+  uint64_t i, n;
+
+  if ((ret = vregionaddmap(vs, r, va, sz, present, writable)) < 0)
+    return ret;
+
+  // kswapd may evict the new pages before they are filled in
+  for (i = 0; i < sz; i += PGSIZE) {
+    n = min((uint64_t)sz - i, (uint64_t)PGSIZE);
+    if (vspacewritepage(vs, va + i, data + i, n) < 0)
+      return -1;
+  }
   return 0;
 }
 
@@ -170,7 +461,7 @@ vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
   vs->regions[VR_CODE].va_base = 0;
   vs->regions[VR_CODE].size = PGROUNDUP(size);
   assertm(
-    vradddata(&vs->regions[VR_CODE], 0, init, size, VPI_PRESENT, VPI_WRITABLE) == 0,
+    vradddata(vs, &vs->regions[VR_CODE], 0, init, size, VPI_PRESENT, VPI_WRITABLE) == 0,
     "failed to allocate init code data"
   );
 
@@ -181,23 +472,50 @@ vspaceinitcode(struct vspace *vs, char *init, uint64_t size)
   vs->regions[VR_USTACK].va_base = stack;
   vs->regions[VR_USTACK].size = PGSIZE;
   assert(
-    vregionaddmap(&vs->regions[VR_USTACK], stack - PGSIZE, PGSIZE, VPI_PRESENT, VPI_WRITABLE) >= 0
+    vregionaddmap(vs, &vs->regions[VR_USTACK], stack - PGSIZE, PGSIZE, VPI_PRESENT, VPI_WRITABLE) >= 0
   );
 
   vspaceinvalidate(vs);
 }
 
+// Marks the pages of [va, va + sz) in the code region as still in
+// the executable, to be read in by vspacefillpage on first touch.
+static int
+vregionaddfile(struct vregion *vr, uint64_t va, uint64_t sz)
+{
+  uint64_t a;
+  struct vpage_info *vpi;
+
+  if (va + sz >= KERNBASE)
+    return -1;
+
+  for (a = PGROUNDDOWN(va); a < va + sz; a += PGSIZE) {
+    if (!(vpi = va2vpage_info(vr, a)))
+      return -1;
+    vpi->used = 1;
+    vpi->file = 1;
+    vpi->present = 0;
+    vpi->writable = VPI_WRITABLE;
+  }
+  return 0;
+}
+
 // loads the code for the given program at 'path' into the
 // vspace for a process. The program must be ELF compliant. The
 // first instruction for the program is returned in the output
 // parameter rip
+//
+// Nothing is read but the headers: the code region's pages are
+// filled from the segments recorded in vs on first touch, and vs
+// keeps a reference to the inode until it is freed.
 int
 vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
 {
   struct inode *ip;
   struct proghdr ph;
-  int off, sz;
-  uint64_t va;
+  struct vseg *seg;
+  int off;
+  uint64_t end;
   struct elfhdr elf;
   int i;
 
@@ -216,8 +534,8 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
   // Set start bound
   vs->regions[VR_CODE].va_base = 0;
 
-  // Load program into memory.
-  va = 0;
+  // Record where each page of the program comes from.
+  end = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto elf_failure;
@@ -227,28 +545,31 @@ vspaceloadcode(struct vspace *vs, char *path, uint64_t *rip)
       goto elf_failure;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto elf_failure;
-
-    if((sz = vregionaddmap(&vs->regions[VR_CODE], (uint64_t)va, ph.vaddr + ph.memsz, VPI_PRESENT, VPI_WRITABLE)) < 0)
-     goto elf_failure;
     if(ph.vaddr % PGSIZE != 0)
       goto elf_failure;
+    if(vs->nsegs == NVSEGS)
+      goto elf_failure;
 
-    va += sz;
-
-    if(vrloaddata(&vs->regions[VR_CODE], ph.vaddr, ip, ph.off, ph.filesz) < 0)
-     goto elf_failure;
+    if(vregionaddfile(&vs->regions[VR_CODE], ph.vaddr, ph.memsz) < 0)
+      goto elf_failure;
+    seg = &vs->segs[vs->nsegs++];
+    seg->va = ph.vaddr;
+    seg->filesz = ph.filesz;
+    seg->memsz = ph.memsz;
+    seg->off = ph.off;
+    end = max(end, ph.vaddr + ph.memsz);
   }
 
   // Set end bound;
-  vs->regions[VR_CODE].size = PGROUNDUP(sz);
+  vs->regions[VR_CODE].size = PGROUNDUP(end);
   // The heap will be right after the code
-  vs->regions[VR_HEAP].va_base = PGROUNDUP(sz);
+  vs->regions[VR_HEAP].va_base = PGROUNDUP(end);
   vs->regions[VR_HEAP].size = 0;
 
   unlocki(ip);
-  irelease(ip);
+  vs->ip = ip;
   *rip = elf.entry;
-  return sz;
+  return end;
 elf_failure:
   if(ip) {
     unlocki(ip);
@@ -285,12 +606,72 @@ vspaceinvalidate(struct vspace *vs)
     assert(start % PGSIZE == 0);
 
     for (; start < end; start += PGSIZE) {
-      vpi = va2vpage_info(vr, start);
+      if (!(vpi = vregionlookup(vr, start)))
+        continue;
       mappages(vs->pgtbl, start >> PT_SHIFT, 1, vpi->ppn, x86perms(vpi), 0);
     }
   }
 }
 
+// Rewrites the PTEs of [va, va + size) in vs from their vpage_infos
+// and drops only those TLB entries, where vspaceinvalidate rebuilds
+// the whole table and flushes the TLB. Page-table pages are allocated
+// as needed. Returns -1 if one cannot be.
+//
+// Each PTE is written with its page locked, so that it agrees with
+// what rmap.c may be changing on another cpu. Page-table pages are
+// allocated before that; a page that comes in between is left
+// unmapped, and mapped by the fault on its first touch.
+int
+vspaceupdate(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a, end;
+  pte_t *pte;
+  int perms, current, n;
+
+  current = myproc() && myproc()->vspace.pgtbl == vs->pgtbl;
+  end = PGROUNDUP(va + size);
+  n = 0;
+  for (a = PGROUNDDOWN(va); a < end; a += PGSIZE, n++) {
+    vpi = (vr = va2vregion(vs, a)) ? vregionlookup(vr, a) : 0;
+    if (vpi && vpi->used && vpi->present &&
+        walkpml4(vs->pgtbl, (char *)a, 1) == 0)
+      return -1;
+    if (vpi)
+      acquire(vpi_lock(vpi));
+    perms = (vpi && vpi->used) ? x86perms(vpi) : 0;
+    pte = walkpml4(vs->pgtbl, (char *)a, 0);
+    if (pte && (perms & PTE_P)) {
+      *pte = PTE((uint64_t)vpi->ppn << PT_SHIFT, perms);
+      mark_user_mem((uint64_t)vpi->ppn << PT_SHIFT);
+    } else if (pte) {
+      *pte = 0;
+    }
+    if (vpi)
+      release(vpi_lock(vpi));
+    if (current && n < INVLPG_MAX)
+      invlpg((void *)a);
+  }
+  // past a few pages, one reload is cheaper than many invlpgs
+  if (current && n >= INVLPG_MAX)
+    lcr3(V2P(vs->pgtbl));
+  return 0;
+}
+
+// vspaceupdate over every region of vs
+int
+vspaceupdateall(struct vspace *vs)
+{
+  struct vregion *vr;
+
+  for (vr = vs->regions; vr < &vs->regions[NREGIONS]; vr++)
+    if (vspaceupdate(vs, VRBOT(vr), VRTOP(vr) - VRBOT(vr)) < 0)
+      return -1;
+  return 0;
+}
+
 // Marks the current user address as not present in the page directory
 // for the passed vspace.
 // user_va must be rounded down to the nearest page.
@@ -304,7 +685,7 @@ void vspacemarknotpresent(struct vspace *vspace, uint64_t user_va) {
   assert(vspace);
   vr = va2vregion(vspace, user_va);
   assert(vr);
-  vpi = va2vpage_info(vr, user_va);
+  vpi = vregionlookup(vr, user_va);
   assert(vpi);
   if (vpi->present) {
     panic("Passed user_va had present vpi.\n");
@@ -336,6 +717,8 @@ vspaceinstall(struct proc *p)
 
   pushcli();  // turn off interrupts
   mycpu()->ts.rsp0 = (uint64_t)p->kstack + KSTACKSIZE;
+  // published first, for tlbshootdown; lcr3 orders the two
+  mycpu()->pgtbl = p->vspace.pgtbl;
   lcr3(V2P(p->vspace.pgtbl));
   popcli();  // turns on interrupts
 }
@@ -345,36 +728,142 @@ void
 vspaceinstallkern(void)
 {
   lcr3(V2P(kpml4));
+  mycpu()->pgtbl = 0;
+}
+
+// pages a vpi tree with height levels of vpi_nodes can index
+static uint64_t
+vpi_span(int height)
+{
+  uint64_t n = VPI_LEAF;
+
+  while (height-- > 0)
+    n *= VPI_FANOUT;
+  return n;
 }
 
-// recrusively frees the page descriptor linked list
-// calling kfree on each page
+// calls fn on every vpage_info in the subtree at node, which has
+// height levels of vpi_nodes
 static void
-free_page_desc_list(struct vpi_page *page)
+vpi_foreach(void *node, int height,
+            void (*fn)(struct vpage_info *, void *), void *arg)
 {
-  assert((uint64_t) page % PGSIZE == 0);
+  int i;
 
-  if (!page)
+  if (!node)
+    return;
+  if (height == 0) {
+    for (i = 0; i < VPI_LEAF; i++)
+      fn(&((struct vpi_page *)node)->infos[i], arg);
     return;
+  }
+  for (i = 0; i < VPI_FANOUT; i++)
+    vpi_foreach(((struct vpi_node *)node)->child[i], height - 1, fn, arg);
+}
+
+// drops the page vpi maps, in memory or swapped out,
+// along with its reverse mapping
+static void
+vpi_freepage(struct vpage_info *vpi, void *arg)
+{
+  uint64_t ppn;
+  int slot;
+
+  if (!vpi->used)
+    return;
+  if (vpi->zero)
+    __sync_fetch_and_sub(&zero_pages, 1);
+  else if (vpi->file)
+    ; // nothing was read in
+  else if (rmap_remove(vpi, &ppn, &slot))
+    kfree(P2V(ppn << PT_SHIFT));
+  else
+    update_swap_ref_ct(-1, slot);
+  vpi->used = 0;
+  vpi->present = 0;
+}
 
-  free_page_desc_list(page->next);
-  kfree((char *)page);
+// drops every page the region maps
+static void
+vregionfreepages(struct vregion *vr)
+{
+  vpi_foreach(vr->root, vr->height, vpi_freepage, 0);
 }
 
-// recursivley frees all swaped_out pages
+// recursively frees the page descriptor tree at node, which has
+// height levels of vpi_nodes, calling kfree on each node and leaf
 static void
-free_swaped_pages(struct vpi_page *page) {
-  assert((uint64_t) page % PGSIZE == 0);
+free_page_desc_tree(void *node, int height)
+{
+  int i;
+
+  assert((uint64_t) node % PGSIZE == 0);
 
-  if (!page)
+  if (!node)
     return;
-  
-  free_swaped_pages(page->next);
-  for (int i = 0; i < VPIPPAGE; i++) {
-    if (page->infos[i].used && page->infos[i].present == 0) {
-      update_swap_ref_ct(-1, page->infos[i].on_disk);
+
+  if (height > 0)
+    for (i = 0; i < VPI_FANOUT; i++)
+      free_page_desc_tree(((struct vpi_node *)node)->child[i], height - 1);
+  kfree((char *)node);
+}
+
+// Writes the pages of a shared, writable file mapping back to the
+// file, up to its current size; the file does not grow. Pages never
+// read in are unchanged and skipped; ones swapped out are brought
+// back first. May sleep.
+static void
+vregionsync(struct vregion *vr)
+{
+  struct vpage_info *vpi;
+  uint64_t a, off;
+  char *mem;
+
+  if (!vr->ip || !(vr->flags & MAP_SHARED) || !(vr->prot & PROT_WRITE))
+    return;
+
+  locki(vr->ip);
+  for (a = VRBOT(vr); a < VRTOP(vr); a += PGSIZE) {
+    off = vr->off + (a - vr->va_base);
+    if (off >= vr->ip->size)
+      break;
+    if (!(vpi = vregionlookup(vr, a)) || !vpi->used || vpi->file)
+      continue;
+    // hold the frame so it cannot be evicted while writei sleeps
+    for (;;) {
+      while (!vpi->present)
+        if (swap_in(vpi->on_disk, 1) < 0)
+          break;
+      acquire(vpi_lock(vpi));
+      mem = vpi->present ? P2V((uint64_t)vpi->ppn << PT_SHIFT) : 0;
+      if (!mem || try_increment_pp_ref_ct(V2P(mem)))
+        break;
+      // being swapped out; bring it back in
+      release(vpi_lock(vpi));
     }
+    release(vpi_lock(vpi));
+    if (!mem)
+      continue;
+    writei(vr->ip, mem, off, min((uint64_t)PGSIZE, vr->ip->size - off));
+    kfree(mem);
   }
+  unlocki(vr->ip);
+}
+
+// Drops region vr and everything it maps, writing a shared file
+// mapping back to its file first, and leaves the slot empty.
+// The caller clears any PTEs still pointing into it.
+static void
+vregionfree(struct vregion *vr)
+{
+  vregionsync(vr);
+  vregionfreepages(vr);
+  free_page_desc_tree(vr->root, vr->height);
+  if (vr->ip)
+    irelease(vr->ip);
+  if (vr->shm)
+    shmrelease(vr->shm);
+  memset(vr, 0, sizeof(struct vregion));
 }
 
 // frees the given vpsace by freeing each page that
@@ -385,13 +874,25 @@ vspacefree(struct vspace *vs)
 {
   struct vregion *vr;
 
-  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
-    free_swaped_pages(vr->pages);
-    free_page_desc_list(vr->pages);
-    memset(vr, 0, sizeof(struct vregion));
-  }
+  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++)
+    vregionfree(vr);
+
+  if (vs->ip)
+    irelease(vs->ip);
+  vs->ip = 0;
 
-  freevm(vs->pgtbl);
+  // a vspace that was moved away has no page table left
+  if (vs->pgtbl)
+    freevm(vs->pgtbl);
+}
+
+// moves the vspace in src to dst and leaves src empty. The reverse
+// mappings of its pages name its page table, which comes along.
+void
+vspacemove(struct vspace *dst, struct vspace *src)
+{
+  *dst = *src;
+  memset(src, 0, sizeof(*src));
 }
 
 void
@@ -400,7 +901,7 @@ vspacefree_wo_pgtbl(struct vspace *vs)
   struct vregion *vr;
 
   for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++) {
-    free_page_desc_list(vr->pages);
+    free_page_desc_tree(vr->root, vr->height);
     memset(vr, 0, sizeof(struct vregion));
   }
 }
@@ -425,35 +926,69 @@ va2vregion(struct vspace *vs, uint64_t va)
   return 0;
 }
 
-// gets the vpage_info struct for the given virtual address va
-// in the vregion
-struct vpage_info*
-va2vpage_info(struct vregion *vr, uint64_t va)
+// walks the page descriptor tree of vr to the vpage_info for va.
+// if alloc is set, allocates the tree nodes on the way to it.
+// returns 0 if a node is missing and cannot be (or may not be)
+// allocated
+static struct vpage_info*
+vpi_walk(struct vregion *vr, uint64_t va, int alloc)
 {
-  int idx;
-  struct vpi_page *info;
-
-  if (!vr->pages) {
-    vr->pages = (struct vpi_page *)kalloc();
-    memset(vr->pages, 0, PGSIZE);
-  }
+  struct vpi_node *node;
+  uint64_t idx, span;
+  void **slot;
+  int h;
 
+  assertm(va2vpi_idx(vr, va) >= 0, "idx was out of bounds");
   idx = va2vpi_idx(vr, va);
-  info = vr->pages;
 
-  while (idx >= VPIPPAGE) {
-    assertm(info, "idx was out of bounds");
-    if (!info->next) {
-      info->next = (struct vpi_page *)kalloc();
-      if (!info->next)
+  // add levels on top until the tree spans idx
+  while (idx >= vpi_span(vr->height)) {
+    if (!alloc)
+      return 0;
+    if (vr->root) {
+      if (!(node = (struct vpi_node *)kalloc()))
         return 0;
-      memset(info->next, 0, PGSIZE);
+      memset(node, 0, PGSIZE);
+      node->child[0] = vr->root;
+      vr->root = node;
     }
-    info = info->next;
-    idx -= VPIPPAGE;
+    vr->height++;
   }
 
-  return &info->infos[idx];
+  slot = &vr->root;
+  for (h = vr->height; ; h--) {
+    if (!*slot) {
+      if (!alloc || !(*slot = kalloc()))
+        return 0;
+      memset(*slot, 0, PGSIZE);
+    }
+    if (h == 0)
+      break;
+    span = vpi_span(h - 1);
+    slot = &((struct vpi_node *)*slot)->child[idx / span];
+    idx %= span;
+  }
+
+  return &((struct vpi_page *)*slot)->infos[idx];
+}
+
+// gets the vpage_info struct for the given virtual address va
+// in the vregion, allocating the tree nodes on the way to it.
+// returns 0 if a node cannot be allocated
+struct vpage_info*
+va2vpage_info(struct vregion *vr, uint64_t va)
+{
+  return vpi_walk(vr, va, 1);
+}
+
+// gets the vpage_info struct for va in the vregion without
+// allocating, for paths that only look at pages. returns 0 if its
+// part of the tree was never allocated, in which case the page is
+// not in use
+struct vpage_info*
+vregionlookup(struct vregion *vr, uint64_t va)
+{
+  return vpi_walk(vr, va, 0);
 }
 
 // Tests if a vregion has [va, va + size) mapped in it's virtual address space.
@@ -479,71 +1014,163 @@ vspacecontains(struct vspace *vs, uint64_t va, int size)
 }
 
 
-// recursively copies the vpi_page struct from src to dst
+// returns the virtual address of the idx-th page of the vregion
+static uint64_t
+vpi_idx2va(struct vregion *r, uint64_t idx)
+{
+  if (r->dir == VRDIR_UP)
+    return r->va_base + (idx << PAGE_SHIFT);
+  else
+    return r->va_base - ((idx + 1) << PAGE_SHIFT);
+}
+
+// copies the vpage_info src, of the page at va, to dst in vs,
+// taking a reference for vs to whatever src maps and making both
+// copy-on-write, unless the page is in a shared mapping
+//
+// The reference is taken first, with src locked, so that it is to
+// what src maps at that moment, and a swap-out leaves the frame alone
+// until dst is recorded as one of its mappings.
 //
 // return 0 on success, -1 if failed
 static int
-copy_vpi_page(struct vpi_page **dst, struct vpi_page *src)
+copy_vpi(struct vspace *vs, uint64_t va, struct vpage_info *dstvpi,
+         struct vpage_info *srcvpi, int shared)
 {
+  struct vpage_info vpi;
+
+  for (;;) {
+    acquire(vpi_lock(srcvpi));
+    if (!srcvpi->used || srcvpi->zero || srcvpi->file)
+      break;
+    if (!srcvpi->present) {
+      increment_swap_ref_ct(srcvpi->on_disk);
+      break;
+    }
+    if (try_increment_pp_ref_ct((uint64_t)srcvpi->ppn << PT_SHIFT))
+      break;
+    // being swapped out; take the slot once it is
+    release(vpi_lock(srcvpi));
+  }
+  if (srcvpi->used && !shared &&
+      (srcvpi->writable || srcvpi->copy_on_write)) {
+    srcvpi->writable = !VPI_WRITABLE;
+    srcvpi->copy_on_write = 1;
+  }
+  vpi = *srcvpi;  // one word; the child shares the now read-only page
+  release(vpi_lock(srcvpi));
+
+  if (!vpi.used)
+    return 0;
+  // dst is filled in before it is visible to swapping
+  *dstvpi = vpi;
+  if (vpi.zero) {
+    __sync_fetch_and_add(&zero_pages, 1);
+  } else if (vpi.file) {
+    // read in from the executable by whoever touches it first
+  } else if (vpi.present) {
+    if (rmap_add(vpi.ppn, vs, va, dstvpi) < 0) {
+      kfree(P2V((uint64_t)vpi.ppn << PT_SHIFT));
+      goto copy_failure;
+    }
+  } else {
+    if (rmap_add_swap(vpi.on_disk, vs, va, dstvpi) < 0) {
+      update_swap_ref_ct(-1, vpi.on_disk);
+      goto copy_failure;
+    }
+  }
+  return 0;
+
+copy_failure:
+  memset(dstvpi, 0, sizeof(*dstvpi));
+  return -1;
+}
+
+// recursively copies the page descriptor tree src, which has height
+// levels of vpi_nodes and holds the pages of vr in vs starting at
+// page index base, to *dst. Nodes not copied yet are left empty in
+// *dst if it fails.
+//
+// return 0 on success, -1 if failed
+static int
+copy_vpi_tree(struct vspace *vs, struct vregion *vr, int height,
+              uint64_t base, void **dst, void *src)
+{
+  struct vpi_page *dstpg, *srcpg;
+  uint64_t span;
   int i;
-  char *data;
-  struct vpage_info *srcvpi, *dstvpi;
 
   if (!src) {
     *dst = 0;
     return 0;
   }
 
-  if (!(*dst = (struct vpi_page *)kalloc()))
+  if (!(*dst = kalloc()))
     return -1;
 
-  memset(*dst, 0, sizeof(struct vpi_page));
+  memset(*dst, 0, PGSIZE);
 
-  for (i = 0; i < VPIPPAGE; i++) {
-    srcvpi = &src->infos[i];
-    dstvpi = &(*dst)->infos[i];
-    if (srcvpi->used) {
-      if (srcvpi->present) {
-        increment_pp_ref_ct(srcvpi->ppn << PT_SHIFT);  // implemented in kalloc.c
-      }
-      dstvpi->used = srcvpi->used;
-      dstvpi->present = srcvpi->present;
-      dstvpi->ppn = srcvpi->ppn;
-      dstvpi->on_disk = srcvpi->on_disk;
-      if (srcvpi->present == 0) {
-        update_swap_ref_ct(1, srcvpi->on_disk);
-      }
-      if (srcvpi->writable || srcvpi->copy_on_write) {
-        srcvpi->writable = !VPI_WRITABLE;
-        srcvpi->copy_on_write = 1;
-        dstvpi->copy_on_write = 1;
-      }
-      dstvpi->writable = !VPI_WRITABLE;
-    }
+  if (height > 0) {
+    span = vpi_span(height - 1);
+    for (i = 0; i < VPI_FANOUT; i++)
+      if (copy_vpi_tree(vs, vr, height - 1, base + i * span,
+                        &((struct vpi_node *)*dst)->child[i],
+                        ((struct vpi_node *)src)->child[i]) < 0)
+        return -1;
+    return 0;
   }
 
-  return copy_vpi_page(&(*dst)->next, src->next);
+  dstpg = *dst;
+  srcpg = src;
+  for (i = 0; i < VPI_LEAF; i++)
+    if (copy_vpi(vs, vpi_idx2va(vr, base + i), &dstpg->infos[i],
+                 &srcpg->infos[i], vr->flags & MAP_SHARED) < 0)
+      return -1;
+  return 0;
 }
 
 // copies the regions and pagesof the src vspace to dst
 int
 vspacecopy(struct vspace *dst, struct vspace *src)
 {
-  struct vregion *vr;
+  int i;
+
+  // a shared mapping must be read in before it is copied, or each
+  // side would read in a page of its own
+  for (i = VR_MMAP; i < NREGIONS; i++)
+    if (src->regions[i].flags & MAP_SHARED &&
+        vspacefillrange(src, VRBOT(&src->regions[i]),
+                        src->regions[i].size) < 0)
+      return -1;
 
   memmove(dst->regions, src->regions, sizeof(struct vregion) * NREGIONS);
+  // pages still in the executable are read in from it by each side
+  memmove(dst->segs, src->segs, sizeof(src->segs));
+  dst->nsegs = src->nsegs;
+  dst->ip = src->ip ? idup(src->ip) : 0;
+  // so that a failed copy leaves dst with only what it has copied
+  for (i = 0; i < NREGIONS; i++) {
+    dst->regions[i].root = 0;
+    if (dst->regions[i].ip)
+      idup(dst->regions[i].ip);
+    if (dst->regions[i].shm)
+      shmdup(dst->regions[i].shm);
+  }
 
-  for (vr = dst->regions; vr < &dst->regions[NREGIONS]; vr++)
-    if (copy_vpi_page(&vr->pages, vr->pages) < 0)
+  for (i = 0; i < NREGIONS; i++)
+    if (copy_vpi_tree(dst, &dst->regions[i], src->regions[i].height, 0,
+                      &dst->regions[i].root, src->regions[i].root) < 0)
       return -1;
 
-  vspaceinvalidate(dst);
-  vspaceinvalidate(src);
+  // In the parent, pages just became read-only. The child's table is
+  // left empty and filled in by faults, so that a child that execs
+  // right away never builds it.
+  if (vspaceupdateall(src) < 0)
+    return -1;
 
   return 0;
 }
 
-
 // initializes the stack region in the user's address space for the
 // given vspace beginning at start and growing down from that address.
 // The stack starts with 1 page.
@@ -555,7 +1182,7 @@ vspaceinitstack(struct vspace *vs, uint64_t start)
   vr->size = PGSIZE;
 
   // stack page
-  if (vregionaddmap(vr, start - PGSIZE, PGSIZE, VPI_PRESENT, VPI_WRITABLE) < 0)
+  if (vregionaddmap(vs, vr, start - PGSIZE, PGSIZE, VPI_PRESENT, VPI_WRITABLE) < 0)
     return -1;
 
   vspaceinvalidate(vs);
@@ -563,6 +1190,163 @@ vspaceinitstack(struct vspace *vs, uint64_t start)
   return 0;
 }
 
+// returns a region of vs that overlaps [va, va + size), or 0
+struct vregion*
+vspaceoverlap(struct vspace *vs, uint64_t va, uint64_t size)
+{
+  struct vregion *vr;
+
+  for (vr = &vs->regions[0]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size > 0 && VRBOT(vr) < va + size && va < VRTOP(vr))
+      return vr;
+  return 0;
+}
+
+// Finds a free mmap slot and room for len bytes, a multiple of the
+// page size, between the heap and the stack limit. va is a hint,
+// taken if it is page aligned and free; otherwise the mapping goes
+// as high as it fits. Returns the slot, placed but with no pages, or
+// 0 if there is no free slot or room.
+static struct vregion*
+vspacemmapslot(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr, *r;
+  uint64_t lo, hi;
+
+  lo = PGROUNDUP(VRTOP(&vs->regions[VR_HEAP]));
+  hi = vs->regions[VR_USTACK].va_base - 10 * PGSIZE; // stack limit
+  if (len == 0 || hi < lo || len > hi - lo)
+    return 0;
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size == 0)
+      break;
+  if (vr == &vs->regions[NREGIONS])
+    return 0;
+
+  if (va % PGSIZE || va < lo || va > hi - len || vspaceoverlap(vs, va, len)) {
+    // move down past each mapping in the way
+    for (va = hi - len; (r = vspaceoverlap(vs, va, len)) != 0; va = VRBOT(r) - len)
+      if (VRBOT(r) < lo + len)
+        return 0;
+  }
+
+  memset(vr, 0, sizeof(struct vregion));
+  vr->dir = VRDIR_UP;
+  vr->va_base = va;
+  vr->size = len;
+  return vr;
+}
+
+// Maps len bytes into vs, at *va if that is free (see
+// vspacemmapslot): the file ip from offset off, or zero-filled
+// memory if ip is 0. *va is set to where the mapping went.
+//
+// File pages are read in on first touch and private anonymous ones
+// are demand-zero. Shared anonymous pages are allocated now, so that
+// a child forked later maps the same frames. vs takes over the
+// caller's reference to ip, unless it fails.
+//
+// returns 0 on success, -1 if there is no free slot, room or memory
+int
+vspacemmap(struct vspace *vs, uint64_t *va, uint64_t len, int prot,
+           int flags, struct inode *ip, uint off)
+{
+  struct vregion *vr;
+  struct vpage_info *vpi;
+  uint64_t a;
+  int writable = (prot & PROT_WRITE) ? VPI_WRITABLE : !VPI_WRITABLE;
+
+  len = PGROUNDUP(len);
+  if (!(vr = vspacemmapslot(vs, *va, len)))
+    return -1;
+  a = vr->va_base;
+  vr->prot = prot;
+  vr->flags = flags;
+  vr->off = off;
+
+  if (ip) {
+    for (; a < vr->va_base + len; a += PGSIZE) {
+      if (!(vpi = va2vpage_info(vr, a)))
+        goto mmap_failure;
+      vpi->used = 1;
+      vpi->file = 1;
+      vpi->present = 0;
+      vpi->writable = writable;
+    }
+    vr->ip = ip;
+  } else if (flags & MAP_SHARED) {
+    if (vregionaddmap(vs, vr, a, len, VPI_PRESENT, writable) < 0)
+      goto mmap_failure;
+  } else {
+    if (vregionaddzero(vr, a, len) < 0)
+      goto mmap_failure;
+    // a read-only page must not be given a frame by a write
+    for (; !writable && a < vr->va_base + len; a += PGSIZE) {
+      assertm(vpi = vregionlookup(vr, a), "vpi info missing");
+      vpi->copy_on_write = 0;
+    }
+  }
+
+  *va = vr->va_base;
+  return vspaceupdate(vs, vr->va_base, len);
+
+mmap_failure:
+  vregionfree(vr);
+  return -1;
+}
+
+// Maps the pages of src, the region holding shared memory object
+// shm's pages, into vs, at *va if that is free (see vspacemmapslot),
+// as a shared mapping of the same frames. *va is set to where the
+// mapping went. The mapping keeps a reference to shm, which the
+// caller has taken for it, unless this fails.
+//
+// returns 0 on success, -1 if there is no free slot, room or memory
+int
+vspacemapshm(struct vspace *vs, uint64_t *va, struct shm *shm,
+             struct vregion *src)
+{
+  struct vregion *vr;
+
+  if (!(vr = vspacemmapslot(vs, *va, src->size)))
+    return -1;
+  vr->prot = PROT_READ | PROT_WRITE;
+  vr->flags = MAP_SHARED;
+  vr->height = src->height;
+  if (copy_vpi_tree(vs, vr, src->height, 0, &vr->root, src->root) < 0) {
+    vregionfree(vr);
+    return -1;
+  }
+  vr->shm = shm;
+  *va = vr->va_base;
+  return vspaceupdate(vs, vr->va_base, vr->size);
+}
+
+// Removes the mapping that starts at va and is len bytes long,
+// rounded up to whole pages; a shared file mapping is written back
+// to its file. Only whole mappings can be removed.
+//
+// returns 0 on success, -1 if there is no such mapping
+int
+vspacemunmap(struct vspace *vs, uint64_t va, uint64_t len)
+{
+  struct vregion *vr, old;
+
+  for (vr = &vs->regions[VR_MMAP]; vr < &vs->regions[NREGIONS]; vr++)
+    if (vr->size > 0 && vr->va_base == va && vr->size == PGROUNDUP(len))
+      break;
+  if (vr == &vs->regions[NREGIONS])
+    return -1;
+
+  // take the region out first, so that its PTEs are cleared
+  // before the frames behind them go
+  old = *vr;
+  memset(vr, 0, sizeof(struct vregion));
+  vspaceupdate(vs, old.va_base, old.size);
+  vregionfree(&old);
+  return 0;
+}
+
 // writes sz amount of the data provided into the virtual address space for the user
 // at va. In the user space corresponding to vs if the data at va accessed it will
 // correspond to the data provided to this method.
@@ -572,27 +1356,17 @@ int
 vspacewritetova(struct vspace *vs, uint64_t va, char *data, int sz)
 {
   uint64_t end, wsz;
-  struct vpage_info *vpi;
-  struct vregion *vr;
 
   assertm(sz > 0, "sz less than or equal to 0");
   assertm(va + sz < KERNBASE, "went over kernel vm base");
 
   end = va + sz;
   while (va < end) {
-    wsz = min((int)(PGROUNDUP(va) - va), sz);
-
-    if (!(vr = va2vregion(vs, va)))
-      return -1;
-
-    vpi = va2vpage_info(vr, va);
-    assert(vpi->used);
+    wsz = min((int)(PGROUNDDOWN(va) + PGSIZE - va), sz);
 
-    if (!vpi->writable)
+    if (vspacewritepage(vs, va, data, wsz) < 0)
       return -1;
 
-    memmove(P2V(vpi->ppn << PT_SHIFT) + (va % PGSIZE), data, wsz);
-
     va += wsz;
     data += wsz;
     sz -= wsz;
@@ -614,12 +1388,13 @@ vspacedumpstack(struct vspace *vs) {
 
   starting_va = vr->va_base - sizeof(uint64_t);
   ending_va = max(vr->va_base - vr->size, vr->va_base - words * (sizeof(uint64_t)));
-  vpi = va2vpage_info(vr, starting_va);
+  if (!(vpi = vregionlookup(vr, starting_va)))
+    return;
 
   cprintf("dumping stack: base=%p size=%d\n", vr->va_base, vr->size);
 
   for (uint64_t va = starting_va; va >= ending_va; va -= sizeof(uint64_t)) {
-    uint64_t la = (uint64_t) P2V(vpi->ppn << PT_SHIFT) + (va % PGSIZE);
+    uint64_t la = (uint64_t) P2V((uint64_t)vpi->ppn << PT_SHIFT) + (va % PGSIZE);
     memmove(&data, (void *) la, sizeof(uint64_t));
     cprintf("virtual address: %x data: %lx\n", va, data);
   }
@@ -635,18 +1410,18 @@ vspacedumpcode(struct vspace*vs) {
   uint64_t ending_va;
 
   starting_va = vr->va_base;
-  vpi = va2vpage_info(vr, starting_va);
+  vpi = vregionlookup(vr, starting_va);
 
   cprintf("dumping code: base=%p size=%d\n", vr->va_base, vr->size);
   int va = starting_va;
   while(vpi && vpi->used) {
     ending_va = va + PGSIZE;
     for (; va < ending_va; va += sizeof(uint64_t)) {
-      uint64_t la = (uint64_t) P2V(vpi->ppn << PT_SHIFT) + (va % PGSIZE);
+      uint64_t la = (uint64_t) P2V((uint64_t)vpi->ppn << PT_SHIFT) + (va % PGSIZE);
       memmove(&data, (void *) la, sizeof(uint64_t));
       cprintf("virtual address: %x data: %lx\n", va, data);
     }
-    vpi = va2vpage_info(vr, va);
+    vpi = vregionlookup(vr, va);
   }
 }
 
@@ -673,10 +1448,12 @@ int vspacemapregions(struct vspace* child, struct vspace* parent) {
     for (int j = 0; j < num_pages; j++) {
       struct vpage_info* p = va2vpage_info(&parent->regions[i], curr_va);
       struct vpage_info* c = va2vpage_info(&child->regions[i], curr_va);
+      if (!p || !c)
+        return -1;
 
       // 3.1. set vpage_info of c to be the same as vpage_info of p
-      acquire(&p->lock);  // possible deadlock here, need to find some ways to walk around
-      acquire(&c->lock);
+      // c is not visible to anyone else yet
+      acquire(vpi_lock(p));
       if (p->used) {
         if (p->writable || p->copy_on_write) {
           p->writable = !VPI_WRITABLE;
@@ -689,9 +1466,8 @@ int vspacemapregions(struct vspace* child, struct vspace* parent) {
         c->used = p->used;
         c->on_disk = p->on_disk;
       }
-      increment_pp_ref_ct(p->ppn << PT_SHIFT);  // implemented in kalloc.c
-      release(&c->lock);
-      release(&p->lock);
+      increment_pp_ref_ct((uint64_t)p->ppn << PT_SHIFT);  // implemented in kalloc.c
+      release(vpi_lock(p));
       // 3.3. decide if go up or go down
       if (dir == VRDIR_UP) {
         curr_va = curr_va + PGSIZE;
@@ -707,32 +1483,84 @@ int vspacemapregions(struct vspace* child, struct vspace* parent) {
 
 // implemented for lab3 copy-on-write fork
 // handles copy_on_write
+//
+// The new frame is allocated and filled, and the reverse mappings
+// moved over to it, before the old frame's reference is dropped;
+// the page is never locked while that is done.
 int vspace_copy_on_write(struct vspace* vs, uint64_t va) {
-  struct vregion* curr_region = va2vregion(vs, va);
-  struct vpage_info* curr_page = va2vpage_info(curr_region, va);
-  acquire(&curr_page->lock);
-  // decrease ref_count if necessary
-  // 1. get PA
-  uint64_t pa = curr_page->ppn << PT_SHIFT;
-  if (cow_copy_out_page(pa, curr_page) == 0) {  // implemented in kalloc.c
-    // 2. since we can just use the page
-    release(&curr_page->lock);
-  } else {  // we need to allocate a new page and copy everything out
-    char* new_page = kalloc();
-    if (!new_page) {
-      release(&curr_page->lock);
+  struct vregion* curr_region;
+  struct vpage_info* curr_page;
+  char *new_page, *old_page = 0;
+  int zero;
+
+  va = PGROUNDDOWN(va);
+  if (!(curr_region = va2vregion(vs, va)) ||
+      !(curr_page = vregionlookup(curr_region, va)))
+    return -1;
+  acquire(vpi_lock(curr_page));
+  // a demand-zero page gets its first private frame
+  zero = curr_page->zero;
+  if (!zero) {
+    if (!curr_page->present && curr_page->file) {
+      // still in its file; there is nothing to copy yet
+      release(vpi_lock(curr_page));
       return -1;
     }
-    // 3. copy everything over
-    memmove(new_page, P2V(curr_page->ppn << PT_SHIFT), PGSIZE);
-    // 4. update current page_info
-    curr_page->writable = 1;
-    curr_page->copy_on_write = 0;
-    curr_page->ppn = V2P(new_page) >> PT_SHIFT;
-    curr_page->present = 1;
-    curr_page->on_disk = 0;
-    release(&curr_page->lock);
+    if (!curr_page->present) {
+      // swapped out since the fault; the retried write swaps it in
+      release(vpi_lock(curr_page));
+      return 0;
+    }
+    // 1. hold on to the page, unless we can just use it
+    old_page = P2V((uint64_t)curr_page->ppn << PT_SHIFT);
+    switch (cow_copy_out_page(V2P(old_page), curr_page)) {  // implemented in kalloc.c
+    case 0:
+      release(vpi_lock(curr_page));
+      return vspaceupdate(vs, va, PGSIZE);
+    case -1:
+      // being swapped out; the retried write swaps it in
+      release(vpi_lock(curr_page));
+      return 0;
+    }
   }
-  vspaceinvalidate(vs);
-  return 0;
-}
\ No newline at end of file
+  release(vpi_lock(curr_page));
+
+  // 2. we need to allocate a new page and copy everything out
+  if (!(new_page = kalloc()))
+    goto cow_failure;
+  if (zero)
+    memset(new_page, 0, PGSIZE);
+  else
+    memmove(new_page, old_page, PGSIZE);
+  if (rmap_add(V2P(new_page) >> PT_SHIFT, vs, va, curr_page) < 0) {
+    kfree(new_page);
+    goto cow_failure;
+  }
+  if (!zero)
+    rmap_del(V2P(old_page) >> PT_SHIFT, curr_page);
+
+  // 3. update current page_info
+  acquire(vpi_lock(curr_page));
+  curr_page->zero = 0;
+  curr_page->writable = 1;
+  curr_page->copy_on_write = 0;
+  curr_page->ppn = V2P(new_page) >> PT_SHIFT;
+  curr_page->present = 1;
+  curr_page->on_disk = 0;
+  release(vpi_lock(curr_page));
+
+  // 4. drop the reference taken above and the one the page held
+  if (zero) {
+    __sync_fetch_and_sub(&zero_pages, 1);
+    __sync_fetch_and_add(&zero_write_faults, 1);
+  } else {
+    kfree(old_page);
+    kfree(old_page);
+  }
+  return vspaceupdate(vs, va, PGSIZE);
+
+cow_failure:
+  if (!zero)
+    kfree(old_page);
+  return -1;
+}
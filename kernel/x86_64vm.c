@@ -10,6 +10,8 @@
 #include <msr.h>
 #include <fs.h>
 #include <file.h>
+#include <trap.h>
+#include <x86_64vm.h>
 
 extern char data[];  // defined by kernel.ld
 pml4e_t *kpml4;  // for use in scheduler()
@@ -49,19 +51,19 @@ seginit(void)
   // Initialize cpu-local storage.
   c->cpu = c;
   c->proc = 0;
+  c->pgtbl = 0;
 };
 
 
-// Return the address of the PTE in page table pgdir
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page table pages.
-pte_t *
-walkpml4(pml4e_t *pml4, const void *va, int alloc)
+// Return the address of the PDE in page table pml4
+// that covers virtual address va.  If alloc!=0,
+// create any required page directory pages.
+static pde_t *
+walkpgdir(pml4e_t *pml4, const void *va, int alloc)
 {
   pml4e_t *pml4e;
   pdpte_t *pdpt, *pdpte;
-  pde_t *pgdir, *pde;
-  pte_t *pgtab;
+  pde_t *pgdir;
 
   pml4e = &pml4[PML4_INDEX(va)];
 
@@ -85,7 +87,23 @@ walkpml4(pml4e_t *pml4, const void *va, int alloc)
     *pdpte = V2P(pgdir) | PTE_P | PTE_W | PTE_U;
   }
 
-  pde = &pgdir[PD_INDEX(va)];
+  return &pgdir[PD_INDEX(va)];
+}
+
+// Return the address of the PTE in page table pml4
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page table pages.  Returns 0 if
+// va is mapped by a 2 MiB page, which has no PTE.
+pte_t *
+walkpml4(pml4e_t *pml4, const void *va, int alloc)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+
+  if ((pde = walkpgdir(pml4, va, alloc)) == 0)
+    return 0;
+  if (*pde & PTE_PS)
+    return 0;
 
   if (*pde & PTE_P) {
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
@@ -119,7 +137,7 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
 
     *pte = PTE(phy_pn << PT_SHIFT, perm);
     if (!kern)
-      mark_user_mem(phy_pn << PT_SHIFT, virt_pn << PT_SHIFT);
+      mark_user_mem(phy_pn << PT_SHIFT);
 
     virt_pn ++;
     phy_pn ++;
@@ -128,15 +146,43 @@ mappages(pml4e_t *pml4, uint64_t virt_pn, int num_page, uint64_t phy_pn, int per
 }
 
 
-// Set up kernel part of a page table.
-pml4e_t*
-setupkvm(void)
+// Maps physical [pa, end) at va for the kernel. Where va and pa are
+// both 2 MiB aligned and a whole 2 MiB page fits, it is mapped with
+// one PDE, so that the direct map takes few page-table pages to
+// build and few TLB entries to use; the rest gets 4 KiB pages.
+static int
+mapkvm(pml4e_t *pml4, uint64_t va, uint64_t pa, uint64_t end, int perm)
+{
+  pde_t *pde;
+
+  while (pa < end) {
+    if (va % PD_SIZE == 0 && pa % PD_SIZE == 0 && end - pa >= PD_SIZE) {
+      if ((pde = walkpgdir(pml4, (char*)va, 1)) == 0)
+        return -1;
+      if (*pde & PTE_P)
+        panic("remap");
+      *pde = pa | perm | PTE_P | PTE_PS;
+      va += PD_SIZE;
+      pa += PD_SIZE;
+    } else {
+      if (mappages(pml4, va >> PT_SHIFT, 1, pa >> PT_SHIFT, perm | PTE_P, 1) < 0)
+        return -1;
+      va += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
+  return 0;
+}
+
+// Build the kernel's page table, kpml4, once at boot. The page-table
+// pages under its kernel half are shared by every address space.
+void
+kvmalloc(void)
 {
   pml4e_t *pml4;
   struct kmap *k;
 
-  if((pml4 = (pml4e_t*)kalloc()) == 0)
-    return 0;
+  assertm(pml4 = (pml4e_t*)kalloc(), "kvmalloc: no memory");
   memset(pml4, 0, PGSIZE);
 
   struct kmap {
@@ -152,9 +198,27 @@ setupkvm(void)
   };
 
   for(k = kmap; k < &kmap[NELEM(kmap)]; k++) {
-    if(mappages(pml4, (uint64_t)(k->virt) >> PT_SHIFT, (k->phys_end - k->phys_start) >> PT_SHIFT, k->phys_start >> PT_SHIFT, k->perm | PTE_P, 1) < 0)
-      return 0;
+    if(mapkvm(pml4, (uint64_t)k->virt, k->phys_start, k->phys_end, k->perm) < 0)
+      panic("kvmalloc: no memory");
   }
+  kpml4 = pml4;
+}
+
+// Set up kernel part of a page table. The whole kernel map lives
+// above KERNBASE, so only its top-level entries are copied from
+// kpml4; the levels below are shared, and so are never freed
+// with a process' table (see freevm).
+pml4e_t*
+setupkvm(void)
+{
+  pml4e_t *pml4;
+  uint i;
+
+  if((pml4 = (pml4e_t*)kalloc()) == 0)
+    return 0;
+  memset(pml4, 0, PGSIZE);
+  for(i = PML4_INDEX(KERNBASE); i < PTRS_PER_PML4; i++)
+    pml4[i] = kpml4[i];
   return pml4;
 }
 
@@ -225,7 +289,8 @@ freevm_pgdir(pde_t *pgdir)
 {
   uint i;
   for (i = 0; i < PTRS_PER_PD; i++) {
-    if (pgdir[i] & PTE_P) {
+    // a 2 MiB page maps memory rather than a page table
+    if ((pgdir[i] & PTE_P) && !(pgdir[i] & PTE_PS)) {
       char *v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
     }
@@ -247,15 +312,15 @@ freevm_pdpt(pdpte_t *pdpt)
 }
 
 
-// Free a page table and all the physical memory pages
-// in the user part.
+// Free a page table. The user pages it maps are owned by the
+// vspace, which frees them through their reverse mappings, and
+// the kernel half belongs to kpml4.
 void
 freevm(pml4e_t *pml4)
 {
   uint i;
   assertm(pml4, "freevm: no pml4");
-  deallocuvm(pml4, 0, SZ_4G, 0);
-  for(i = 0; i < PTRS_PER_PML4; i++){
+  for(i = 0; i < PML4_INDEX(KERNBASE); i++){
     if(pml4[i] & PTE_P){
       pdpte_t *pdpt = P2V(PDPT_ADDR(pml4[i]));
       freevm_pdpt(pdpt);
@@ -263,3 +328,47 @@ freevm(pml4e_t *pml4)
   }
   kfree((char*)pml4);
 }
+
+// Flushes va from the TLB of every cpu running on page table pgtbl,
+// waiting until the others have, after a change to one of its PTEs.
+// A cpu that is running on pgtbl installed it after mycpu()->pgtbl
+// was set, so one that starts to afterwards reads the new PTE.
+void
+tlbshootdown(pml4e_t *pgtbl, uint64_t va)
+{
+  struct cpu *c;
+  uint t;
+
+  pushcli();
+  __sync_synchronize(); // the PTE change comes before the reads of pgtbl
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c->pgtbl != pgtbl)
+      continue;
+    if(c == mycpu()){
+      invlpg((void*)va);
+      continue;
+    }
+    t = __sync_add_and_fetch(&c->tlbreq, 1);
+    lapicipi(c->apicid, TRAP_IRQ0 + IRQ_TLBFLUSH);
+    // c may be spinning with interrupts off, waiting on this cpu
+    // for a lock or for a flush of its own, so serve those meanwhile
+    while((int)(c->tlbdone - t) < 0)
+      tlbflushack();
+  }
+  popcli();
+}
+
+// Flushes this cpu's TLB if another cpu has asked for that since
+// it last did. Called on the IPI tlbshootdown() sends, and from
+// loops that spin with interrupts off.
+void
+tlbflushack(void)
+{
+  struct cpu *c = mycpu();
+  uint req = c->tlbreq;
+
+  if(c->tlbdone != req){
+    lcr3(rcr3());
+    c->tlbdone = req;
+  }
+}
@@ -0,0 +1,261 @@
+// Compressed in-memory swap tier.
+//
+// swap_out() offers each page it evicts to zswap before writing it
+// to the swap area on disk. A page that compresses well is kept in a
+// pool of memory set aside at boot, keyed by the swap slot it was
+// given, and its disk blocks are never written. Pages go to disk only
+// when they do not compress or the pool is full.
+//
+// Pages are compressed with a small LZSS coder: groups of eight items
+// led by a flag byte, each item either a literal byte or a 2-byte
+// (12-bit offset, 4-bit length) back reference into the page.
+//
+// The pool is carved into ZS_UNIT-byte units handed out first-fit
+// from a bitmap. zswap.lock protects everything here and is taken
+// after kmem.lock.
+//
+// Built only with CONFIG_ZSWAP (see kernel/Makefrag); otherwise the
+// functions below do nothing and every page goes to disk.
+
+#include <cdefs.h>
+#include <defs.h>
+#include <fs.h>
+#include <memlayout.h>
+#include <mmu.h>
+#include <param.h>
+#include <spinlock.h>
+
+#ifdef CONFIG_ZSWAP
+
+#define ZS_UNIT 64                                  // pool allocation unit
+#define ZS_NUNITS (ZSWAP_POOL_PAGES * PGSIZE / ZS_UNIT)
+#define ZS_MAXLEN (PGSIZE * 3 / 4) // don't keep pages that compress worse
+#define ZS_HASH_BITS 10
+#define ZS_MINMATCH 3
+#define ZS_MAXMATCH (ZS_MINMATCH + 15)
+#define ZS_WINDOW 4096
+
+struct {
+  struct spinlock lock;
+  char *pool;                     // 0 if the pool could not be allocated
+  uint map[ZS_NUNITS / 32];       // allocated units
+  int rotor;                      // where the next unit search starts
+  struct {
+    ushort unit;                  // first unit of the compressed data
+    ushort len;                   // its length in bytes, 0 if not stored
+  } slot[SWAPSIZE_PAGES];
+  int pages;                      // pages stored
+  int bytes;                      // compressed bytes stored
+  int units;                      // units in use
+  ushort hash[1 << ZS_HASH_BITS]; // compressor: last position + 1 of a prefix
+  uchar buf[PGSIZE];              // compressor output
+} zswap;
+
+void zswapinit(void) {
+  int order;
+
+  initlock(&zswap.lock, "zswap");
+  for (order = 0; (1 << order) < ZSWAP_POOL_PAGES; order++)
+    ;
+  if ((zswap.pool = kalloc_pages(order)) == 0)
+    cprintf("zswap: no memory for the pool\n");
+}
+
+static uint zs_hashof(const uchar *p) {
+  uint v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return (v * 2654435761U) >> (32 - ZS_HASH_BITS);
+}
+
+// Compresses the page at in into out. Returns the compressed length,
+// or -1 if it would be longer than limit.
+static int lz_compress(const uchar *in, uchar *out, int limit) {
+  int ip = 0, op = 0, flagpos = 0, bit = 8;
+  int cand, len, off, max;
+  uint h;
+
+  memset(zswap.hash, 0, sizeof(zswap.hash));
+  while (ip < PGSIZE) {
+    if (bit == 8) {
+      if (op >= limit)
+        return -1;
+      flagpos = op++;
+      out[flagpos] = 0;
+      bit = 0;
+    }
+    len = 0;
+    off = 0;
+    if (ip + ZS_MINMATCH <= PGSIZE) {
+      h = zs_hashof(in + ip);
+      cand = zswap.hash[h] - 1;
+      zswap.hash[h] = ip + 1;
+      if (cand >= 0 && ip - cand <= ZS_WINDOW) {
+        max = min(ZS_MAXMATCH, PGSIZE - ip);
+        while (len < max && in[cand + len] == in[ip + len])
+          len++;
+        off = ip - cand;
+      }
+    }
+    if (len >= ZS_MINMATCH) {
+      if (op + 2 > limit)
+        return -1;
+      out[flagpos] |= 1 << bit;
+      out[op++] = (off - 1) >> 4;
+      out[op++] = ((off - 1) & 0xf) << 4 | (len - ZS_MINMATCH);
+      ip += len;
+    } else {
+      if (op + 1 > limit)
+        return -1;
+      out[op++] = in[ip++];
+    }
+    bit++;
+  }
+  return op;
+}
+
+static void lz_decompress(const uchar *in, int n, uchar *out) {
+  int ip = 0, op = 0, bit = 8;
+  int off, len;
+  uchar flags = 0;
+
+  while (ip < n && op < PGSIZE) {
+    if (bit == 8) {
+      flags = in[ip++];
+      bit = 0;
+      continue;
+    }
+    if (flags & (1 << bit)) {
+      off = ((in[ip] << 4) | (in[ip + 1] >> 4)) + 1;
+      len = (in[ip + 1] & 0xf) + ZS_MINMATCH;
+      ip += 2;
+      if (off > op || op + len > PGSIZE)
+        panic("zswap: corrupt page");
+      for (; len > 0; len--, op++)
+        out[op] = out[op - off];
+    } else {
+      out[op++] = in[ip++];
+    }
+    bit++;
+  }
+  if (op != PGSIZE)
+    panic("zswap: short page");
+}
+
+// Finds n contiguous free units and marks them used.
+// Returns the first, or -1.
+static int zs_alloc(int n) {
+  int i, j, run, scanned;
+
+  run = 0;
+  i = zswap.rotor;
+  for (scanned = 0; scanned < ZS_NUNITS + n; scanned++, i++) {
+    if (i == ZS_NUNITS) {
+      i = 0;
+      run = 0;
+    }
+    if (zswap.map[i / 32] & (1U << (i % 32))) {
+      run = 0;
+      continue;
+    }
+    if (++run == n) {
+      for (j = i - n + 1; j <= i; j++)
+        zswap.map[j / 32] |= 1U << (j % 32);
+      zswap.rotor = (i + 1) % ZS_NUNITS;
+      zswap.units += n;
+      return i - n + 1;
+    }
+  }
+  return -1;
+}
+
+// Tries to keep the page at va, which is being swapped out to slot,
+// compressed in memory. Returns 1 if it did, 0 if the page has to be
+// written to disk.
+int zswap_store(int slot, char *va) {
+  int len, n, unit;
+
+  if (!zswap.pool)
+    return 0;
+  acquire(&zswap.lock);
+  if (zswap.slot[slot].len)
+    panic("zswap_store: slot in use");
+  if ((len = lz_compress((uchar *)va, zswap.buf, ZS_MAXLEN)) < 0)
+    goto store_failure;
+  n = (len + ZS_UNIT - 1) / ZS_UNIT;
+  if ((unit = zs_alloc(n)) < 0)
+    goto store_failure;
+  memmove(zswap.pool + unit * ZS_UNIT, zswap.buf, len);
+  zswap.slot[slot].unit = unit;
+  zswap.slot[slot].len = len;
+  zswap.pages++;
+  zswap.bytes += len;
+  release(&zswap.lock);
+  return 1;
+
+store_failure:
+  release(&zswap.lock);
+  return 0;
+}
+
+// returns 1 if slot's page is kept in the pool
+int zswap_has(int slot) {
+  return zswap.slot[slot].len != 0;
+}
+
+// Decompresses slot's page into va. Returns 0 if it is not in the
+// pool. The caller keeps the slot referenced while this runs.
+int zswap_load(int slot, char *va) {
+  int unit, len;
+
+  acquire(&zswap.lock);
+  if ((len = zswap.slot[slot].len) == 0) {
+    release(&zswap.lock);
+    return 0;
+  }
+  unit = zswap.slot[slot].unit;
+  release(&zswap.lock);
+
+  lz_decompress((uchar *)zswap.pool + unit * ZS_UNIT, len, (uchar *)va);
+  return 1;
+}
+
+// Drops slot's page from the pool, if it is there, once the slot
+// is freed.
+void zswap_invalidate(int slot) {
+  int i, n, unit, len;
+
+  acquire(&zswap.lock);
+  if ((len = zswap.slot[slot].len) != 0) {
+    unit = zswap.slot[slot].unit;
+    n = (len + ZS_UNIT - 1) / ZS_UNIT;
+    for (i = unit; i < unit + n; i++)
+      zswap.map[i / 32] &= ~(1U << (i % 32));
+    zswap.units -= n;
+    zswap.pages--;
+    zswap.bytes -= len;
+    zswap.slot[slot].len = 0;
+  }
+  release(&zswap.lock);
+}
+
+// Reports pages stored, their compressed size, and the bytes of the
+// pool in use and in total, for sysinfo.
+void zswap_stats(int *pages, int *bytes, int *used, int *size) {
+  *pages = zswap.pages;
+  *bytes = zswap.bytes;
+  *used = zswap.units * ZS_UNIT;
+  *size = zswap.pool ? ZSWAP_POOL_PAGES * PGSIZE : 0;
+}
+
+#else
+
+void zswapinit(void) {}
+int zswap_store(int slot, char *va) { return 0; }
+int zswap_has(int slot) { return 0; }
+int zswap_load(int slot, char *va) { return 0; }
+void zswap_invalidate(int slot) {}
+
+void zswap_stats(int *pages, int *bytes, int *used, int *size) {
+  *pages = *bytes = *used = *size = 0;
+}
+
+#endif
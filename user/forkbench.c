@@ -0,0 +1,86 @@
+// Measures the latency of starting a program and waiting for it, as
+// the shell does for every command, with fork+exec, vfork+exec and
+// spawn, as the parent's heap grows. fork copies the parent's page
+// descriptors and write-protects all its pages for a child that
+// throws them away at exec. vfork lends the parent's address space
+// to the child, and spawn builds the child's from the program, so
+// their cost should not depend on the heap size.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define PAGE 4096
+#define ROUNDS 16 // launches timed per heap size and call
+
+enum { FORK, VFORK, SPAWN };
+
+static char *child_argv[] = {"forkbench", "-child", 0};
+
+// runs the benchmark itself as a child that exits right away,
+// and returns the cycles until it has been waited for
+static uint64_t launch(int how) {
+  uint64_t t;
+  int pid;
+
+  t = rdtsc();
+  if (how == SPAWN)
+    pid = spawn(child_argv[0], child_argv, 0);
+  else
+    pid = how == VFORK ? vfork() : fork();
+  if (pid < 0) {
+    printf(stdout, "forkbench: launch failed\n");
+    exit();
+  }
+  if (pid == 0) {
+    exec(child_argv[0], child_argv);
+    printf(stdout, "forkbench: exec failed\n");
+    exit();
+  }
+  wait();
+  return rdtsc() - t;
+}
+
+static void bench(int npages) {
+  uint64_t forkt = 0, vforkt = 0, spawnt = 0;
+  char *heap;
+  int i;
+
+  // give the parent a heap of private pages
+  heap = sbrk(npages * PAGE);
+  if (heap == (char *)-1) {
+    printf(stdout, "forkbench: sbrk of %d pages failed\n", npages);
+    exit();
+  }
+  for (i = 0; i < npages; i++)
+    heap[i * PAGE] = 1;
+
+  for (i = 0; i < ROUNDS; i++) {
+    forkt += launch(FORK);
+    vforkt += launch(VFORK);
+    spawnt += launch(SPAWN);
+  }
+  printf(stdout, "heap %d pages: cycles for fork+exec %d, vfork+exec %d, "
+         "spawn %d\n", npages, (int)(forkt / ROUNDS), (int)(vforkt / ROUNDS),
+         (int)(spawnt / ROUNDS));
+}
+
+int main(int argc, char *argv[]) {
+  static int sizes[] = {0, 64, 256, 1024};
+  int i;
+
+  if (argc > 1) // a child being exec'd
+    exit();
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    // a fresh process for each size
+    if (fork() == 0) {
+      bench(sizes[i]);
+      exit();
+    }
+    wait();
+  }
+  exit();
+}
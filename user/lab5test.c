@@ -56,6 +56,8 @@ void swaptest(void) {
 
     printf(stdout, "number of disk reads = %d\n",
            info2.num_disk_reads - info1.num_disk_reads);
+    printf(stdout, "number of page faults = %d\n",
+           info2.num_page_faults - info1.num_page_faults);
 
     sysinfo(&info3);
     printf(stdout, "number of pages in swap = %d\n", info3.pages_in_swap);
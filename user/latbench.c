@@ -0,0 +1,84 @@
+// Measures interactive latency under background load. A process
+// sends a byte through a pipe to a child that echoes it back, as a
+// shell waits on keystrokes; each round trip wakes both sides once.
+// This runs alone, next to HOGS CPU-bound processes, and next to the
+// same hogs niced to the lowest priority. The hogs drop to low
+// levels of the scheduler's queues while the echo pair, which mostly
+// sleeps, stays high and so should not wait behind them.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define HOGS 4
+#define TRIPS 200 // round trips timed
+
+// returns the mean cycles per round trip
+static int roundtrips(void) {
+  int up[2], down[2], i;
+  uint64_t t;
+  char c = 0;
+
+  if (pipe(up) < 0 || pipe(down) < 0) {
+    printf(stdout, "latbench: pipe failed\n");
+    exit();
+  }
+  if (fork() == 0) {
+    close(up[1]);
+    close(down[0]);
+    while (read(up[0], &c, 1) == 1)
+      write(down[1], &c, 1);
+    exit();
+  }
+  close(up[0]);
+  close(down[1]);
+  t = rdtsc();
+  for (i = 0; i < TRIPS; i++) {
+    write(up[1], &c, 1);
+    read(down[0], &c, 1);
+  }
+  t = rdtsc() - t;
+  close(up[1]);
+  close(down[0]);
+  wait();
+  return t / TRIPS;
+}
+
+static void hogs(int *pids, int niceness) {
+  int i;
+
+  for (i = 0; i < HOGS; i++) {
+    if ((pids[i] = fork()) == 0) {
+      nice(niceness);
+      for (;;)
+        ;
+    }
+  }
+}
+
+static void killhogs(int *pids) {
+  int i;
+
+  for (i = 0; i < HOGS; i++)
+    kill(pids[i]);
+  for (i = 0; i < HOGS; i++)
+    wait();
+}
+
+int main(int argc, char *argv[]) {
+  int pids[HOGS];
+
+  printf(stdout, "idle: %d cycles per round trip\n", roundtrips());
+
+  hogs(pids, 0);
+  printf(stdout, "%d hogs: %d cycles per round trip\n", HOGS, roundtrips());
+  killhogs(pids);
+
+  hogs(pids, 100); // clamped to the lowest level
+  printf(stdout, "%d niced hogs: %d cycles per round trip\n", HOGS,
+         roundtrips());
+  killhogs(pids);
+  exit();
+}
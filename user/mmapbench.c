@@ -0,0 +1,101 @@
+// Measures the cost of scanning a file, as wc or grep do, through
+// read() into a buffer and through mmap(). read() copies every byte
+// from the buffer cache into the process; a private mapping reads
+// each page in once, on first touch, and the scan then runs on the
+// mapped pages directly. Both scans must agree on the file's checksum.
+// Then checks that a shared anonymous mapping is shared with a child.
+
+#include <cdefs.h>
+#include <fcntl.h>
+#include <mman.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define ROUNDS 8 // scans timed per method
+
+static char buf[512];
+
+static uint sum(char *p, int n, uint s) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    s = s * 31 + (uchar)p[i];
+  return s;
+}
+
+static uint readscan(char *path) {
+  uint s = 0;
+  int fd, n;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    printf(stdout, "mmapbench: cannot open %s\n", path);
+    exit();
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    s = sum(buf, n, s);
+  close(fd);
+  return s;
+}
+
+static uint mmapscan(char *path) {
+  struct stat st;
+  char *p;
+  uint s;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    printf(stdout, "mmapbench: cannot open %s\n", path);
+    exit();
+  }
+  p = mmap(0, st.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping keeps the file
+  if (p == MAP_FAILED) {
+    printf(stdout, "mmapbench: mmap failed\n");
+    exit();
+  }
+  s = sum(p, st.size, 0);
+  munmap(p, st.size);
+  return s;
+}
+
+static void shared(void) {
+  int *p;
+
+  p = mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED) {
+    printf(stdout, "mmapbench: anonymous mmap failed\n");
+    exit();
+  }
+  *p = 1;
+  if (fork() == 0) {
+    *p = 2;
+    exit();
+  }
+  wait();
+  printf(stdout, "shared mapping: %s\n", *p == 2 ? "ok" : "FAILED");
+  munmap(p, 4096);
+}
+
+int main(int argc, char *argv[]) {
+  char *path = argc > 1 ? argv[1] : "sh";
+  uint64_t t, readt = 0, mmapt = 0;
+  uint rs = 0, ms = 0;
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    t = rdtsc();
+    rs = readscan(path);
+    readt += rdtsc() - t;
+    t = rdtsc();
+    ms = mmapscan(path);
+    mmapt += rdtsc() - t;
+  }
+  printf(stdout, "%s: read %d cycles, mmap %d cycles per scan\n", path,
+         (int)(readt / ROUNDS), (int)(mmapt / ROUNDS));
+  if (rs != ms)
+    printf(stdout, "mmapbench: checksums differ\n");
+  shared();
+  exit();
+}
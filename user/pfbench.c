@@ -0,0 +1,56 @@
+// Measures the cost of a page fault as the address space grows.
+// For each heap size, every page of the heap is first read, which
+// maps it to the shared zero page and so costs no memory, then
+// further pages are added and written once, so every sample is the
+// demand-zero write fault of a process of that size. The cycles per
+// fault should stay flat as the heap grows.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define PAGE 4096
+#define ROUNDS 32 // faults timed per heap size
+
+static void bench(int npages) {
+  volatile char *heap;
+  char *p;
+  uint64_t t, total = 0;
+  int i;
+
+  // build up the address space
+  heap = sbrk(npages * PAGE);
+  if (heap == (char *)-1) {
+    printf(stdout, "pfbench: sbrk of %d pages failed\n", npages);
+    exit();
+  }
+  for (i = 0; i < npages; i++)
+    (void)heap[i * PAGE];
+
+  // time one first-write fault at a time
+  for (i = 0; i < ROUNDS; i++) {
+    p = sbrk(PAGE);
+    t = rdtsc();
+    *p = 1;
+    total += rdtsc() - t;
+  }
+  printf(stdout, "heap %d pages: %d cycles per fault\n", npages,
+         (int)(total / ROUNDS));
+}
+
+int main(int argc, char *argv[]) {
+  static int sizes[] = {16, 256, 1024, 4096};
+  int i;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    // a fresh process for each size
+    if (fork() == 0) {
+      bench(sizes[i]);
+      exit();
+    }
+    wait();
+  }
+  exit();
+}
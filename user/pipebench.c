@@ -0,0 +1,71 @@
+// Pipe ping-pong: two processes pass a byte back and forth, so every
+// round trip is two wakeups. It runs once with no other processes
+// and once with IDLERS more asleep, blocked reading another pipe. A
+// wakeup looks only at the sleepers on its channel's wait queue, so
+// the idle sleepers should barely change the time.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define TRIPS 5000
+#define IDLERS 40
+
+// returns the mean cycles per round trip
+static int pingpong(void) {
+  int up[2], down[2], i;
+  uint64_t t;
+  char c = 0;
+
+  if (pipe(up) < 0 || pipe(down) < 0) {
+    printf(stdout, "pipebench: pipe failed\n");
+    exit();
+  }
+  if (fork() == 0) {
+    close(up[1]);
+    close(down[0]);
+    while (read(up[0], &c, 1) == 1)
+      write(down[1], &c, 1);
+    exit();
+  }
+  close(up[0]);
+  close(down[1]);
+  t = rdtsc();
+  for (i = 0; i < TRIPS; i++) {
+    write(up[1], &c, 1);
+    read(down[0], &c, 1);
+  }
+  t = rdtsc() - t;
+  close(up[1]);
+  close(down[0]);
+  wait();
+  return t / TRIPS;
+}
+
+int main(int argc, char *argv[]) {
+  int fds[2], i;
+  char c;
+
+  printf(stdout, "alone: %d cycles per round trip\n", pingpong());
+
+  if (pipe(fds) < 0) {
+    printf(stdout, "pipebench: pipe failed\n");
+    exit();
+  }
+  for (i = 0; i < IDLERS; i++) {
+    if (fork() == 0) {
+      close(fds[1]);
+      read(fds[0], &c, 1); // sleeps until the write end closes
+      exit();
+    }
+  }
+  close(fds[0]);
+  printf(stdout, "%d sleepers: %d cycles per round trip\n", IDLERS,
+         pingpong());
+  close(fds[1]);
+  for (i = 0; i < IDLERS; i++)
+    wait();
+  exit();
+}
@@ -0,0 +1,50 @@
+// Measures the scheduler. Yield ping-pong: two processes yield to
+// each other, so every yield is a switch through the run queue.
+// Throughput: many processes, all runnable at once, each yield
+// ROUNDS times; the total time shows how queueing, and with more
+// than one cpu, stealing, scale with the number of runnable
+// processes.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define PINGPONG 10000 // yields per ping-pong process
+#define ROUNDS 1000    // yields per throughput process
+
+// runs n processes that each yield rounds times; returns cycles taken
+static uint64_t yielders(int n, int rounds) {
+  uint64_t t;
+  int i, j;
+
+  t = rdtsc();
+  for (i = 0; i < n; i++) {
+    if (fork() == 0) {
+      for (j = 0; j < rounds; j++)
+        yield();
+      exit();
+    }
+  }
+  for (i = 0; i < n; i++)
+    wait();
+  return rdtsc() - t;
+}
+
+int main(int argc, char *argv[]) {
+  static int procs[] = {1, 4, 16, 48};
+  uint64_t t;
+  int i;
+
+  t = yielders(2, PINGPONG);
+  printf(stdout, "ping-pong: %d cycles per yield\n",
+         (int)(t / (2 * PINGPONG)));
+
+  for (i = 0; i < sizeof(procs) / sizeof(procs[0]); i++) {
+    t = yielders(procs[i], ROUNDS);
+    printf(stdout, "%d runnable: %d cycles per yield\n", procs[i],
+           (int)(t / (procs[i] * ROUNDS)));
+  }
+  exit();
+}
@@ -2,6 +2,7 @@
 
 #include <cdefs.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <user.h>
 
 // Parsed command representation
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void); // Fork but panics on failure.
 void panic(char *);
 struct cmd *parsecmd(char *);
+void freecmd(struct cmd *);
 
 // Execute cmd.  Never returns.
 void runcmd(struct cmd *cmd) {
@@ -128,6 +130,82 @@ void runcmd(struct cmd *cmd) {
   exit();
 }
 
+// Returns whether cmd is made only of programs, redirections and
+// pipes, so that the shell can start it with spawn instead of fork.
+int spawnable(struct cmd *cmd) {
+  struct pipecmd *pcmd;
+
+  switch (cmd->type) {
+  case EXEC:
+    return 1;
+  case REDIR:
+    return spawnable(((struct redircmd *)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd *)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// Starts the programs of a spawnable cmd without forking the shell.
+// The redirections and pipe ends each program needs are handed to
+// spawn as file actions, after the nacts already in acts.
+// Returns the number of processes started, for the caller to wait for.
+int spawncmd(struct cmd *cmd, struct spawn_action *acts, int nacts) {
+  int p[2], fd, n;
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if (nacts + 3 >= SPAWN_MAXACT) {
+    printf(2, "too many redirections\n");
+    return 0;
+  }
+
+  switch (cmd->type) {
+  case EXEC:
+    ecmd = (struct execcmd *)cmd;
+    if (ecmd->argv[0] == 0)
+      return 0;
+    acts[nacts].op = SPAWN_END;
+    if (spawn(ecmd->argv[0], ecmd->argv, acts) < 0) {
+      printf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd *)cmd;
+    if ((fd = open(rcmd->file, rcmd->mode)) < 0) {
+      printf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    acts[nacts++] = (struct spawn_action){SPAWN_DUP, fd, rcmd->fd};
+    acts[nacts++] = (struct spawn_action){SPAWN_CLOSE, fd, 0};
+    n = spawncmd(rcmd->cmd, acts, nacts);
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd *)cmd;
+    if (pipe(p) < 0) {
+      printf(2, "pipe failed\n");
+      return 0;
+    }
+    acts[nacts] = (struct spawn_action){SPAWN_DUP, p[1], 1};
+    acts[nacts + 1] = (struct spawn_action){SPAWN_CLOSE, p[0], 0};
+    acts[nacts + 2] = (struct spawn_action){SPAWN_CLOSE, p[1], 0};
+    n = spawncmd(pcmd->left, acts, nacts + 3);
+    acts[nacts] = (struct spawn_action){SPAWN_DUP, p[0], 0};
+    n += spawncmd(pcmd->right, acts, nacts + 3);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  panic("spawncmd");
+  return 0;
+}
+
 int getcmd(char *buf, int nbuf) {
   printf(2, "$ ");
   memset(buf, 0, nbuf);
@@ -139,7 +217,9 @@ int getcmd(char *buf, int nbuf) {
 
 int main(void) {
   static char buf[100];
-  int fd;
+  struct spawn_action acts[SPAWN_MAXACT];
+  struct cmd *cmd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while ((fd = open("console", O_RDWR)) >= 0) {
@@ -158,9 +238,17 @@ int main(void) {
         printf(2, "cannot cd %s\n", buf + 3);
       continue;
     }
-    if (fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait();
+    if ((cmd = parsecmd(buf)) == 0)
+      continue;
+    if (spawnable(cmd)) {
+      for (n = spawncmd(cmd, acts, 0); n > 0; n--)
+        wait();
+    } else {
+      if (fork1() == 0)
+        runcmd(cmd);
+      wait();
+    }
+    freecmd(cmd);
   }
   exit();
 }
@@ -236,8 +324,41 @@ struct cmd *backcmd(struct cmd *subcmd) {
   cmd->cmd = subcmd;
   return (struct cmd *)cmd;
 }
+// Frees cmd and everything under it.
+void freecmd(struct cmd *cmd) {
+  if (cmd == 0)
+    return;
+
+  switch (cmd->type) {
+  case REDIR:
+    freecmd(((struct redircmd *)cmd)->cmd);
+    break;
+  case PIPE:
+    freecmd(((struct pipecmd *)cmd)->left);
+    freecmd(((struct pipecmd *)cmd)->right);
+    break;
+  case LIST:
+    freecmd(((struct listcmd *)cmd)->left);
+    freecmd(((struct listcmd *)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd *)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
+
 // Parsing
 
+// The shell parses commands itself rather than in a forked child,
+// so syntax errors are recorded here instead of ending the process.
+char *syntax_error;
+
+void syntax(char *msg) {
+  if (syntax_error == 0)
+    syntax_error = msg;
+}
+
 char whitespace[] = " \t\r\n\v";
 char symbols[] = "<|>&;()";
 
@@ -299,16 +420,23 @@ struct cmd *parsepipe(char **, char *);
 struct cmd *parseexec(char **, char *);
 struct cmd *nulterminate(struct cmd *);
 
+// Returns the parsed command, or 0 after reporting a syntax error.
 struct cmd *parsecmd(char *s) {
   char *es;
   struct cmd *cmd;
 
+  syntax_error = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if (s != es) {
+  if (s != es && syntax_error == 0) {
     printf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if (syntax_error) {
+    printf(2, "%s\n", syntax_error);
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -346,8 +474,10 @@ struct cmd *parseredirs(struct cmd *cmd, char **ps, char *es) {
 
   while (peek(ps, es, "<>")) {
     tok = gettoken(ps, es, 0, 0);
-    if (gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if (gettoken(ps, es, &q, &eq) != 'a') {
+      syntax("missing file for redirection");
+      break;
+    }
     switch (tok) {
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -370,8 +500,10 @@ struct cmd *parseblock(char **ps, char *es) {
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if (!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if (!peek(ps, es, ")")) {
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -394,13 +526,17 @@ struct cmd *parseexec(char **ps, char *es) {
   while (!peek(ps, es, "|)&;")) {
     if ((tok = gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if (tok != 'a')
-      panic("syntax");
+    if (tok != 'a') {
+      syntax("syntax");
+      break;
+    }
+    if (argc >= MAXARGS - 1) {
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if (argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
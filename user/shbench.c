@@ -0,0 +1,58 @@
+// Measures how long the shell takes to launch a command. sh is run
+// on a script of ROUNDS trivial commands fed through a pipe, and
+// timed until it exits; the time for an empty script is subtracted
+// to leave the cost of the commands alone. (sh prints a prompt for
+// every command it reads.)
+
+#include <cdefs.h>
+#include <spawn.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define ROUNDS 32 // commands in the script
+
+static char *sh_argv[] = {"sh", 0};
+static char cmd[] = "shbench -child\n";
+
+// runs sh on a script of n commands and returns the cycles it took
+static uint64_t runsh(int n) {
+  struct spawn_action acts[4];
+  uint64_t t;
+  int p[2], i;
+
+  if (pipe(p) < 0) {
+    printf(stdout, "shbench: pipe failed\n");
+    exit();
+  }
+  acts[0] = (struct spawn_action){SPAWN_DUP, p[0], 0};
+  acts[1] = (struct spawn_action){SPAWN_CLOSE, p[0], 0};
+  acts[2] = (struct spawn_action){SPAWN_CLOSE, p[1], 0};
+  acts[3].op = SPAWN_END;
+
+  t = rdtsc();
+  if (spawn(sh_argv[0], sh_argv, acts) < 0) {
+    printf(stdout, "shbench: spawn sh failed\n");
+    exit();
+  }
+  close(p[0]);
+  for (i = 0; i < n; i++)
+    write(p[1], cmd, sizeof(cmd) - 1);
+  close(p[1]);
+  wait();
+  return rdtsc() - t;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t base, total;
+
+  if (argc > 1) // one of the commands
+    exit();
+
+  base = runsh(0);
+  total = runsh(ROUNDS);
+  printf(stdout, "\nsh: %d cycles per command\n",
+         (int)((total - base) / ROUNDS));
+  exit();
+}
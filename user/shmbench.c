@@ -0,0 +1,128 @@
+// Measures moving data from a producer to a consumer process through
+// a pipe and through a shared memory object. The pipe copies every
+// byte into the kernel and out again; with shared memory the producer
+// fills one half of the object while the consumer reads the other,
+// and only a one-byte token per half goes through pipes.
+// Both transfers must arrive with the same checksum.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define TOTAL (512 * 1024) // bytes moved per transfer
+#define CHUNK 2048         // bytes per pipe write
+#define HALF (8 * 4096)    // bytes per shared memory half
+
+static char buf[CHUNK];
+
+static void fill(char *p, int n, int off) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    p[i] = (off + i) * 7;
+}
+
+static uint sum(char *p, int n, uint s) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    s = s * 31 + (uchar)p[i];
+  return s;
+}
+
+static void xread(int fd, char *p, int n) {
+  int r;
+
+  for (; n > 0; n -= r, p += r) {
+    if ((r = read(fd, p, n)) <= 0) {
+      printf(stdout, "shmbench: short read\n");
+      exit();
+    }
+  }
+}
+
+static uint viapipe(void) {
+  int fds[2], off;
+  uint s = 0;
+
+  if (pipe(fds) < 0) {
+    printf(stdout, "shmbench: pipe failed\n");
+    exit();
+  }
+  if (fork() == 0) {
+    close(fds[0]);
+    for (off = 0; off < TOTAL; off += CHUNK) {
+      fill(buf, CHUNK, off);
+      write(fds[1], buf, CHUNK);
+    }
+    exit();
+  }
+  close(fds[1]);
+  for (off = 0; off < TOTAL; off += CHUNK) {
+    xread(fds[0], buf, CHUNK);
+    s = sum(buf, CHUNK, s);
+  }
+  close(fds[0]);
+  wait();
+  return s;
+}
+
+static uint viashm(void) {
+  int full[2], empty[2], id, off;
+  char *mem, token = 0;
+  uint s = 0;
+
+  if ((id = shm_open("shmbench", 2 * HALF)) < 0 ||
+      (mem = shm_map(id, 0)) == (char *)-1) {
+    printf(stdout, "shmbench: shm failed\n");
+    exit();
+  }
+  shm_unlink("shmbench"); // gone once both sides unmap it
+  if (pipe(full) < 0 || pipe(empty) < 0) {
+    printf(stdout, "shmbench: pipe failed\n");
+    exit();
+  }
+  if (fork() == 0) {
+    close(full[0]);
+    close(empty[1]);
+    for (off = 0; off < TOTAL; off += HALF) {
+      if (off >= 2 * HALF)
+        xread(empty[0], &token, 1);
+      fill(mem + off % (2 * HALF), HALF, off);
+      write(full[1], &token, 1);
+    }
+    exit();
+  }
+  close(full[1]);
+  close(empty[0]);
+  for (off = 0; off < TOTAL; off += HALF) {
+    xread(full[0], &token, 1);
+    s = sum(mem + off % (2 * HALF), HALF, s);
+    write(empty[1], &token, 1);
+  }
+  close(full[0]);
+  close(empty[1]);
+  wait();
+  munmap(mem, 2 * HALF);
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t t, pipet, shmt;
+  uint ps, ss;
+
+  t = rdtsc();
+  ps = viapipe();
+  pipet = rdtsc() - t;
+  t = rdtsc();
+  ss = viashm();
+  shmt = rdtsc() - t;
+
+  printf(stdout, "%d KB: pipe %d cycles, shm %d cycles\n", TOTAL / 1024,
+         (int)pipet, (int)shmt);
+  if (ps != ss)
+    printf(stdout, "shmbench: checksums differ\n");
+  exit();
+}
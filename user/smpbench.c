@@ -0,0 +1,55 @@
+// Runs a parallel-build style workload: JOBS CPU-bound children, the
+// way make -j starts one compiler per source file. The jobs first run
+// one after another, then all at once; with more than one cpu (e.g.
+// make qemu NR_CPUS=4) the second run should finish faster.
+
+#include <cdefs.h>
+#include <stat.h>
+#include <user.h>
+
+int stdout = 1;
+
+#define JOBS 4
+#define WORK (1 << 23) // iterations per job
+
+static volatile uint result; // keeps the work from being optimized out
+
+static void job(void) {
+  uint s = 0;
+  int i;
+
+  for (i = 0; i < WORK; i++)
+    s = s * 1103515245 + 12345 + i;
+  result = s;
+}
+
+// starts n jobs at a time until JOBS have run
+static uint64_t run(int n) {
+  uint64_t t;
+  int i, j;
+
+  t = rdtsc();
+  for (i = 0; i < JOBS; i += n) {
+    for (j = i; j < JOBS && j < i + n; j++) {
+      if (fork() == 0) {
+        job();
+        exit();
+      }
+    }
+    for (j = i; j < JOBS && j < i + n; j++)
+      wait();
+  }
+  return rdtsc() - t;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t serial, parallel;
+
+  serial = run(1);
+  parallel = run(JOBS);
+  printf(stdout, "%d jobs: serial %d cycles, parallel %d cycles\n", JOBS,
+         (int)serial, (int)parallel);
+  printf(stdout, "speedup %d.%d\n", (int)(serial / parallel),
+         (int)(serial * 10 / parallel % 10));
+  exit();
+}
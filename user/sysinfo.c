@@ -6,6 +6,12 @@
 
 int main(int argc, char *argv[]) {
   struct sys_info info;
+
+  // sysinfo low high: retune kswapd's watermarks first
+  if (argc == 3 && setwmark(atoi(argv[1]), atoi(argv[2])) < 0) {
+    printf(2, "sysinfo: bad watermarks\n");
+    exit();
+  }
   sysinfo(&info);
 
   printf(1, "pages_in_use = %d\n", info.pages_in_use);
@@ -13,6 +19,28 @@ int main(int argc, char *argv[]) {
   printf(1, "free_pages = %d\n", info.free_pages);
   printf(1, "num_page_faults = %d\n", info.num_page_faults);
   printf(1, "num_disk_reads = %d\n", info.num_disk_reads);
+  printf(1, "pcp_hits = %d\n", info.pcp_hits);
+  printf(1, "pcp_misses = %d\n", info.pcp_misses);
+  printf(1, "wmark_low = %d\n", info.wmark_low);
+  printf(1, "wmark_high = %d\n", info.wmark_high);
+  printf(1, "kswapd_pages = %d\n", info.kswapd_pages);
+  printf(1, "direct_reclaims = %d\n", info.direct_reclaims);
+  printf(1, "ra_pages = %d\n", info.ra_pages);
+  printf(1, "ra_hits = %d\n", info.ra_hits);
+  printf(1, "ra_misses = %d\n", info.ra_misses);
+  printf(1, "zswap_pages = %d\n", info.zswap_pages);
+  printf(1, "zswap_bytes = %d\n", info.zswap_bytes);
+  if (info.zswap_bytes > 0)
+    printf(1, "zswap_ratio = %d%%\n",
+           (int)((long)info.zswap_pages * 4096 * 100 / info.zswap_bytes));
+  printf(1, "zswap_pool = %d / %d\n", info.zswap_pool_used,
+         info.zswap_pool_size);
+  printf(1, "zero_pages = %d\n", info.zero_pages);
+  printf(1, "zero_read_faults = %d\n", info.zero_read_faults);
+  printf(1, "zero_write_faults = %d\n", info.zero_write_faults);
+  printf(1, "pcache_pages = %d\n", info.pcache_pages);
+  printf(1, "pcache_hits = %d\n", info.pcache_hits);
+  printf(1, "pcache_misses = %d\n", info.pcache_misses);
 
   exit();
 }
@@ -84,4 +84,12 @@ void *memmove(void *vdst, void *vsrc, int n) {
   while (n-- > 0)
     *dst++ = *src++;
   return vdst;
-}
\ No newline at end of file
+}
+
+// reads the cpu's time-stamp counter, for timing benchmarks
+uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}